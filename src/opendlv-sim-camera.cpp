@@ -15,15 +15,31 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
 #include <vector>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
@@ -31,6 +47,11 @@
 #include <GL/glew.h>
 #include <GL/glx.h>
 
+#if defined(HAVE_EGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
 #define GLM_ENABLE_EXPERIMENTAL
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -53,17 +74,22 @@
 typedef GLXContext (*glXCreateContextAttribsARBProc)(Display*, GLXFBConfig, 
     GLXContext, Bool, int32_t const *);
 
+// The layer selects the image of the texture array the mesh is textured from.
+// It is the same for all vertices of a mesh and assigned after vertices have
+// been deduplicated, so it takes no part in comparisons.
 struct Vertex {
   glm::vec3 pos;
   glm::vec3 color;
   glm::vec2 texCoord;
+  float layer;
 
-  Vertex(): pos(), color(), texCoord() {}
+  Vertex(): pos(), color(), texCoord(), layer() {}
 
   Vertex(glm::vec3 a_pos, glm::vec2 a_texCoord, glm::vec3 a_color): 
     pos(a_pos),
     color(a_color), 
-    texCoord(a_texCoord) {}
+    texCoord(a_texCoord),
+    layer() {}
 
   bool operator==(Vertex const &a) const {
     return (pos == a.pos && color == a.color && texCoord == a.texCoord);
@@ -128,19 +154,131 @@ struct ModelInfo {
     color(a_color) {}
 };
 
+// How map textures are filtered, set by the "textureFilter" (nearest,
+// bilinear, trilinear or anisotropic) and "textureAnisotropy" keys of the map.
+// All but nearest sample from a mip chain generated at load. Textures are
+// downscaled by halving to the resolution the camera can resolve, given by
+// texelsPerMeter for surfaces at the closest viewing distance, and to at most
+// maxSize texels along each side. Zero disables either limit. If compress is
+// set, textures are stored S3TC compressed where the driver supports it.
+struct TextureOptions {
+  std::string filter;
+  float anisotropy;
+  float texelsPerMeter;
+  uint32_t maxSize;
+  bool compress;
+
+  TextureOptions():
+    filter("trilinear"),
+    anisotropy(8.0f),
+    texelsPerMeter(),
+    maxSize(),
+    compress(false) {}
+};
+
+// An S3TC compressed image with its mip levels, from full size down to 1x1.
+struct CompressedImage {
+  GLenum format;
+  int32_t width;
+  int32_t height;
+  std::vector<std::vector<uint8_t>> levels;
+
+  CompressedImage():
+    format(),
+    width(),
+    height(),
+    levels() {}
+};
+
+struct TextureLayer {
+  GLuint textureId;
+  uint32_t layer;
+  bool isOpaque;
+
+  TextureLayer():
+    textureId(),
+    layer(),
+    isOpaque(true) {}
+};
+
+// A CPU copy of the images of a texture array, kept for the software
+// renderer. Layers are stored as RGBA, in array order, each followed by its
+// mip chain. Level l starts at levelOffsets[l] of a layer and is
+// max(1, width >> l) by max(1, height >> l) texels. The filters are those
+// of the GL texture, which the software renderer samples alike.
+struct SoftwareTexture {
+  int32_t width;
+  int32_t height;
+  std::vector<std::vector<uint8_t>> layers;
+  std::vector<size_t> levelOffsets;
+  GLenum minFilter;
+  GLenum magFilter;
+
+  SoftwareTexture():
+    width(),
+    height(),
+    layers(),
+    levelOffsets(),
+    minFilter(GL_NEAREST),
+    magFilter(GL_NEAREST) {}
+};
+
+struct MeshGeometry {
+  std::vector<Vertex> vertices;
+  std::vector<uint32_t> indices;
+
+  MeshGeometry():
+    vertices(),
+    indices() {}
+};
+
+// Instances are only ever rotated around the z axis, so the bounding sphere is
+// centred on that axis to stay valid for any instance rotation. Simplified
+// levels of detail of a mesh are stored as separate handles with consecutive
+// ids, from firstLodMeshId and increasingly coarse, where lodCellSize is the
+// size of the clusters the level was simplified with. Meshes are transparent
+// if their texture has any texel that is not fully opaque.
 struct MeshHandle {
   GLuint vao;
   GLuint textureId;
   uint32_t indexOffset;
   uint32_t indexCount;
+  uint32_t instanceOffset;
+  uint32_t staticInstanceCount;
+  uint32_t dynamicInstanceSlots;
+  uint32_t instanceCapacity;
+  uint32_t instanceCount;
+  uint32_t firstLodMeshId;
+  uint32_t lodCount;
+  float lodCellSize;
+  uint64_t drawKey;
+  glm::vec3 boundsMin;
+  glm::vec3 boundsMax;
+  glm::vec3 boundingCenter;
+  float boundingRadius;
   bool isOrthogonal;
+  bool isTransparent;
 
   MeshHandle():
     vao(),
     textureId(),
     indexOffset(),
     indexCount(),
-    isOrthogonal() {}
+    instanceOffset(),
+    staticInstanceCount(),
+    dynamicInstanceSlots(),
+    instanceCapacity(),
+    instanceCount(),
+    firstLodMeshId(),
+    lodCount(),
+    lodCellSize(),
+    drawKey(),
+    boundsMin(),
+    boundsMax(),
+    boundingCenter(),
+    boundingRadius(),
+    isOrthogonal(),
+    isTransparent() {}
 
   MeshHandle(uint32_t a_indexOffset, uint32_t a_indexCount,
       bool a_isOrthogonal):
@@ -148,285 +286,3298 @@ struct MeshHandle {
     textureId(),
     indexOffset(a_indexOffset),
     indexCount(a_indexCount),
-    isOrthogonal(a_isOrthogonal) {}
+    instanceOffset(),
+    staticInstanceCount(),
+    dynamicInstanceSlots(),
+    instanceCapacity(),
+    instanceCount(),
+    firstLodMeshId(),
+    lodCount(),
+    lodCellSize(),
+    drawKey(),
+    boundsMin(),
+    boundsMax(),
+    boundingCenter(),
+    boundingRadius(),
+    isOrthogonal(a_isOrthogonal),
+    isTransparent() {}
 };
 
-static bool isExtensionSupported(char const *extList, char const *extension) {
-  char const *where = strchr(extension, ' ');
-  if (where || *extension == '\0') {
-    return false;
-  }
-  for (char const *start = extList;;) {
-    where = strstr(start, extension);
-    if (!where) {
-      break;
-    }
-    char const *terminator = where + strlen(extension);
-    if (where == start || *(where - 1) == ' ') {
-      if (*terminator == ' ' || *terminator == '\0') {
-        return true;
-      }
-    }
-    start = terminator;
-  }
-  return false;
-}
-
-static bool ctxErrorOccurred = false;
-static int32_t ctxErrorHandler(Display *, XErrorEvent *) {
-  ctxErrorOccurred = true;
-  return 0;
-}
+struct DrawStats {
+  uint32_t drawnInstances;
+  uint32_t culledInstances;
+  uint32_t drawCalls;
+  uint32_t stateChanges;
+  uint64_t drawnTriangles;
+
+  DrawStats():
+    drawnInstances(),
+    culledInstances(),
+    drawCalls(),
+    stateChanges(),
+    drawnTriangles() {}
+};
 
-std::map<std::string, MeshHandle> loadModels(std::vector<ModelInfo> modelInfo,
-    std::vector<BlockInfo> blockInfo, GLuint const *vbo, bool verbose)
-{
-  struct Model {
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indices;
-    std::string name;
-    std::string textureFilename;
-    bool isOrthogonal;
+// Draws are sorted by a key packing, from the most significant bits, the
+// pass, a coarse depth bucket, the texture and the vertex array, so that
+// opaque draws go roughly front to back while draws sharing state still end
+// up next to each other. All scene draws share one program, so it takes no
+// part in the key. The mesh id is kept in the lowest bits. The depth bucket
+// is filled in every frame. Transparent draws instead replace the fields
+// below the pass by their inverted depth, so that they are drawn back to
+// front.
+uint32_t const drawKeyPassShift{62};
+uint32_t const drawKeyDepthBucketShift{56};
+uint32_t const drawKeyTextureShift{40};
+uint32_t const drawKeyVaoShift{24};
+uint64_t const drawKeyTextureMask{(uint64_t{1} << (drawKeyDepthBucketShift 
+      - drawKeyTextureShift)) - 1};
+uint64_t const drawKeyVaoMask{(uint64_t{1} << (drawKeyTextureShift 
+      - drawKeyVaoShift)) - 1};
+uint64_t const drawKeyMeshIdMask{(1 << drawKeyVaoShift) - 1};
+uint64_t const drawKeyDepthMask{(uint64_t{1} << (drawKeyPassShift 
+      - drawKeyVaoShift)) - 1};
+
+// Only transparent meshes and overlays are blended, and neither writes depth.
+uint32_t const drawPassOpaque{0};
+uint32_t const drawPassTransparent{1};
+uint32_t const drawPassOverlay{2};
+
+// Remembers the GL state last set while drawing the scene, so that redundant
+// calls can be skipped. The bindings must be invalidated whenever other code
+// may have changed them.
+struct GlStateCache {
+  GLuint program;
+  GLuint texture;
+  GLuint vao;
+  bool depthMask;
+  bool blend;
+  uint32_t stateChanges;
 
-    Model(std::string const &a_name):
-      vertices(), 
-      indices(), 
-      name(a_name),
-      textureFilename(),
-      isOrthogonal(false) {}
-  };
+  GlStateCache():
+    program(),
+    texture(),
+    vao(),
+    depthMask(true),
+    blend(false),
+    stateChanges() {}
+
+  void invalidateBindings() {
+    program = std::numeric_limits<GLuint>::max();
+    texture = std::numeric_limits<GLuint>::max();
+    vao = std::numeric_limits<GLuint>::max();
+  }
 
-  std::vector<Model> models;
+  void useProgram(GLuint a_program) {
+    if (program != a_program) {
+      glUseProgram(a_program);
+      program = a_program;
+      stateChanges++;
+    }
+  }
 
-  for (auto info : modelInfo) {
-    Model model(info.name);
-    model.textureFilename = info.textureFilename;
+  void bindTexture(GLuint a_texture) {
+    if (texture != a_texture) {
+      glBindTexture(GL_TEXTURE_2D_ARRAY, a_texture);
+      texture = a_texture;
+      stateChanges++;
+    }
+  }
 
-    if (verbose) {
-      std::cout << "Loading model '" << info.name << "'" << std::endl;
+  void bindVertexArray(GLuint a_vao) {
+    if (vao != a_vao) {
+      glBindVertexArray(a_vao);
+      vao = a_vao;
+      stateChanges++;
     }
+  }
 
-    tinyobj::attrib_t attrib;
-    std::vector<tinyobj::shape_t> shapes;
-    std::vector<tinyobj::material_t> materials;
-    std::string warn, err;
+  void setDepthMask(bool a_depthMask) {
+    if (depthMask != a_depthMask) {
+      glDepthMask(a_depthMask);
+      depthMask = a_depthMask;
+      stateChanges++;
+    }
+  }
 
-    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, 
-          info.modelFilename.c_str())) {
-        throw std::runtime_error(warn + err);
+  void setBlend(bool a_blend) {
+    if (blend != a_blend) {
+      if (a_blend) {
+        glEnable(GL_BLEND);
+      } else {
+        glDisable(GL_BLEND);
+      }
+      blend = a_blend;
+      stateChanges++;
     }
+  }
+};
 
-    std::unordered_map<Vertex, uint32_t> uniqueVertices = {};
+// Mesh instances stored as a struct of arrays, one row per instance. Meshes
+// are referred to by the dense ids interned while loading the map.
+struct MeshInstances {
+  std::vector<uint32_t> meshId;
+  std::vector<glm::vec3> position;
+  std::vector<float> rotation;
+  std::vector<uint8_t> visible;
 
-    for (auto const &shape : shapes) {
-      for (auto const &index : shape.mesh.indices) {
-        Vertex vertex = {};
+  MeshInstances():
+    meshId(), position(), rotation(), visible() {}
 
-        vertex.pos = {
-          attrib.vertices[3 * index.vertex_index + 0],
-          attrib.vertices[3 * index.vertex_index + 1],
-          attrib.vertices[3 * index.vertex_index + 2]
-        };
+  uint32_t size() const {
+    return static_cast<uint32_t>(meshId.size());
+  }
 
-        if (attrib.texcoords.size() > 0) {
-          vertex.texCoord = {
-            attrib.texcoords[2 * index.texcoord_index + 0],
-            1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
-          };
-        }
+  uint32_t add(uint32_t a_meshId, glm::vec3 a_position, float a_rotation,
+      bool a_visible) {
+    meshId.push_back(a_meshId);
+    position.push_back(a_position);
+    rotation.push_back(a_rotation);
+    visible.push_back(a_visible);
+    return size() - 1;
+  }
+};
 
-        vertex.color = info.color;
+// Uniform grid over the xy plane holding the static instances, so that the
+// instances near the view frustum can be found without visiting the whole map.
+// The instances of each cell are stored contiguously, and each cell keeps the
+// bounding box of its instances. Overlays and instances much larger than a
+// cell are kept aside and always tested individually.
+struct InstanceGrid {
+  glm::vec2 origin;
+  float cellSize;
+  float maxRadius;
+  uint32_t columns;
+  uint32_t rows;
+  std::vector<uint32_t> cellStart;
+  std::vector<uint32_t> cellInstances;
+  std::vector<glm::vec3> cellMin;
+  std::vector<glm::vec3> cellMax;
+  std::vector<uint32_t> unindexedInstances;
+
+  InstanceGrid():
+    origin(),
+    cellSize(1.0f),
+    maxRadius(),
+    columns(),
+    rows(),
+    cellStart(),
+    cellInstances(),
+    cellMin(),
+    cellMax(),
+    unindexedInstances() {}
+};
 
-        if (uniqueVertices.count(vertex) == 0) {
-          uniqueVertices[vertex] = static_cast<uint32_t>(model.vertices.size());
-          model.vertices.push_back(vertex);
-        }
+// One entry in the ring of pixel buffer objects that the rendered images are
+// read back into. The fence is signaled when both readbacks have finished.
+// Buffers that are persistently mapped keep their mapping here, otherwise the
+// pointers are null and the buffers are mapped for every publish.
+struct ReadbackSlot {
+  GLuint pboArgb;
+  GLuint pboI420;
+  void const *dataArgb;
+  void const *dataI420;
+  GLsync fence;
+  cluon::data::TimeStamp sampleTimeStamp;
+
+  ReadbackSlot():
+    pboArgb(),
+    pboI420(),
+    dataArgb(),
+    dataI420(),
+    fence(),
+    sampleTimeStamp() {}
+};
 
-        model.indices.push_back(uniqueVertices[vertex]);
-      }
+// Copies with non-temporal stores where available, since the destination is
+// shared memory that the producer will not read again.
+static void streamCopy(uint8_t *dst, uint8_t const *src, size_t size) {
+#if defined(__SSE2__)
+  size_t head = (16 - (reinterpret_cast<uintptr_t>(dst) & 15)) & 15;
+  head = std::min(head, size);
+  memcpy(dst, src, head);
+  size_t i{head};
+  for (; i + 64 <= size; i += 64) {
+    __m128i const a = _mm_loadu_si128(
+        reinterpret_cast<__m128i const *>(src + i));
+    __m128i const b = _mm_loadu_si128(
+        reinterpret_cast<__m128i const *>(src + i + 16));
+    __m128i const c = _mm_loadu_si128(
+        reinterpret_cast<__m128i const *>(src + i + 32));
+    __m128i const d = _mm_loadu_si128(
+        reinterpret_cast<__m128i const *>(src + i + 48));
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst + i), a);
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst + i + 16), b);
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst + i + 32), c);
+    _mm_stream_si128(reinterpret_cast<__m128i *>(dst + i + 48), d);
+  }
+  memcpy(dst + i, src + i, size - i);
+  _mm_sfence();
+#else
+  memcpy(dst, src, size);
+#endif
+}
+
+// Splits large copies over a few persistent threads, so that the shared
+// memory is kept locked for as short a time as possible while publishing.
+class StreamCopier {
+ public:
+  explicit StreamCopier(uint32_t a_threadCount):
+    threads(),
+    mutex(),
+    wake(),
+    done(),
+    dst(),
+    src(),
+    size(),
+    generation(),
+    pending(),
+    stop()
+  {
+    for (uint32_t i{1}; i < a_threadCount; i++) {
+      threads.emplace_back([this, i]() { work(i); });
     }
-    models.push_back(model);
   }
 
-  for (auto info : blockInfo) {
-    Model model(info.name);
-    model.textureFilename = info.textureFilename;
+  StreamCopier(StreamCopier const &) = delete;
+  StreamCopier &operator=(StreamCopier const &) = delete;
 
-    if (verbose) {
-      if (!info.isOrthogonal) {
-        std::cout << "Generating box '" << info.name << "'" << std::endl;
-      } else {
-        std::cout << "Generating overlay '" << info.name << "'" << std::endl;
-      }
+  ~StreamCopier()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto &thread : threads) {
+      thread.join();
     }
+  }
 
-    float const xh = info.dimension.x / 2.0f;
-    float const yh = info.dimension.y / 2.0f;
-    float const zh = info.dimension.z / 2.0f;
-    float xtw = info.dimension.x / info.textureSize.x;
-    float ytw = info.dimension.y / info.textureSize.x;
-    float yth = info.dimension.y / info.textureSize.y;
-    float zth = info.dimension.z / info.textureSize.y;
-    if (info.textureFilename.empty()) {
-      xtw = 0.0f;
-      ytw = 0.0f;
-      yth = 0.0f;
-      zth = 0.0f;
+  void copy(void *a_dst, void const *a_src, size_t a_size)
+  {
+    if (threads.empty() || a_size < 65536) {
+      streamCopy(static_cast<uint8_t *>(a_dst), 
+          static_cast<uint8_t const *>(a_src), a_size);
+      return;
     }
-    if (info.isOrthogonal) {
-      xtw = -1.0f;
-      ytw = -1.0f;
-      yth = -1.0f;
-      zth = -1.0f;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      dst = static_cast<uint8_t *>(a_dst);
+      src = static_cast<uint8_t const *>(a_src);
+      size = a_size;
+      pending = static_cast<uint32_t>(threads.size());
+      generation++;
     }
+    wake.notify_all();
+    copyChunk(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return pending == 0; });
+  }
 
-    model.vertices.push_back({{-xh, -yh, -zh}, {0.0f, 0.0f}, info.color});
-    model.vertices.push_back({{xh, -yh, -zh}, {xtw, 0.0f}, info.color});
-    model.vertices.push_back({{xh, yh, -zh}, {xtw, yth}, info.color});
-    model.vertices.push_back({{-xh, yh, -zh}, {0, yth}, info.color});
+ private:
+  void work(uint32_t a_index)
+  {
+    uint64_t seenGeneration{0};
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [this, &seenGeneration]() { 
+          return stop || generation != seenGeneration; });
+      if (stop) {
+        return;
+      }
+      seenGeneration = generation;
+      lock.unlock();
+      copyChunk(a_index);
+      lock.lock();
+      if (--pending == 0) {
+        done.notify_one();
+      }
+    }
+  }
 
-    model.vertices.push_back({{-xh, -yh, zh}, {0.0f, 0.0f}, info.color});
-    model.vertices.push_back({{xh, -yh, zh}, {xtw, 0.0f}, info.color});
-    model.vertices.push_back({{xh, yh, zh}, {xtw, yth}, info.color});
-    model.vertices.push_back({{-xh, yh, zh}, {0, yth}, info.color});
-    
-    model.vertices.push_back({{-xh, -yh, -zh}, {0.0f, 0.0f}, info.color});
-    model.vertices.push_back({{xh, -yh, -zh}, {xtw, 0.0f}, info.color});
-    model.vertices.push_back({{xh, -yh, zh}, {xtw, zth}, info.color});
-    model.vertices.push_back({{-xh, -yh, zh}, {0, zth}, info.color});
-    
-    model.vertices.push_back({{-xh, yh, -zh}, {0.0f, 0.0f}, info.color});
-    model.vertices.push_back({{xh, yh, -zh}, {xtw, 0.0f}, info.color});
-    model.vertices.push_back({{xh, yh, zh}, {xtw, zth}, info.color});
-    model.vertices.push_back({{-xh, yh, zh}, {0, zth}, info.color});
+  void copyChunk(uint32_t a_index)
+  {
+    size_t const chunkCount = threads.size() + 1;
+    size_t const chunkSize = ((size + chunkCount - 1) / chunkCount + 63) 
+      & ~static_cast<size_t>(63);
+    size_t const begin = std::min(size, a_index * chunkSize);
+    size_t const end = std::min(size, begin + chunkSize);
+    streamCopy(dst + begin, src + begin, end - begin);
+  }
 
-    model.vertices.push_back({{-xh, -yh, -zh}, {0.0f, 0.0f}, info.color});
-    model.vertices.push_back({{-xh, yh, -zh}, {ytw, 0.0f}, info.color});
-    model.vertices.push_back({{-xh, yh, zh}, {ytw, zth}, info.color});
-    model.vertices.push_back({{-xh, -yh, zh}, {0, zth}, info.color});
-    
-    model.vertices.push_back({{xh, -yh, -zh}, {0.0f, 0.0f}, info.color});
-    model.vertices.push_back({{xh, yh, -zh}, {ytw, 0.0f}, info.color});
-    model.vertices.push_back({{xh, yh, zh}, {ytw, zth}, info.color});
-    model.vertices.push_back({{xh, -yh, zh}, {0, zth}, info.color});
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  uint8_t *dst;
+  uint8_t const *src;
+  size_t size;
+  uint64_t generation;
+  uint32_t pending;
+  bool stop;
+};
 
-    for (uint32_t i{0}; i <= 20; i = i + 4) {
-      model.indices.push_back(i);
-      model.indices.push_back(i + 1);
-      model.indices.push_back(i + 2);
-      model.indices.push_back(i);
-      model.indices.push_back(i + 2);
-      model.indices.push_back(i + 3);
+// Runs a task on a few persistent threads and the calling one, passing each
+// its index. The task splits up the work itself, for example by pulling
+// items from a shared counter, so that threads finishing early take over
+// work from the others.
+class WorkerPool {
+ public:
+  explicit WorkerPool(uint32_t a_threadCount):
+    threads(),
+    mutex(),
+    wake(),
+    done(),
+    task(),
+    generation(),
+    pending(),
+    stop()
+  {
+    for (uint32_t i{1}; i < a_threadCount; i++) {
+      threads.emplace_back([this, i]() { work(i); });
     }
+  }
 
-    model.isOrthogonal = info.isOrthogonal;
+  WorkerPool(WorkerPool const &) = delete;
+  WorkerPool &operator=(WorkerPool const &) = delete;
 
-    models.push_back(model);
+  ~WorkerPool()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wake.notify_all();
+    for (auto &thread : threads) {
+      thread.join();
+    }
   }
 
-  uint32_t vertexCount{0};
-  uint32_t indexCount{0};
-  for (Model model : models) {
-    vertexCount += model.vertices.size();
-    indexCount += model.indices.size();
+  uint32_t size() const
+  {
+    return static_cast<uint32_t>(threads.size()) + 1;
   }
-  
+
+  void run(std::function<void(uint32_t)> const &a_task)
   {
-    uint32_t dataSizeTotal = 8 * vertexCount * sizeof(float);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-    glBufferData(GL_ARRAY_BUFFER, dataSizeTotal, 0, GL_STATIC_DRAW);
+    if (threads.empty()) {
+      a_task(0);
+      return;
+    }
     {
-      uint32_t bufferPos{0};
-      for (Model model : models) {
-        uint32_t dataSize = 8 * model.vertices.size() * sizeof(float);
-        glBufferSubData(GL_ARRAY_BUFFER, bufferPos, dataSize,
-            model.vertices.data());
-        bufferPos += dataSize;
-      }
+      std::lock_guard<std::mutex> lock(mutex);
+      task = &a_task;
+      pending = static_cast<uint32_t>(threads.size());
+      generation++;
     }
+    wake.notify_all();
+    a_task(0);
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this]() { return pending == 0; });
   }
 
-  std::map<std::string, MeshHandle> handles;
+ private:
+  void work(uint32_t a_index)
   {
-    uint32_t dataSizeTotal = indexCount * sizeof(uint32_t);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, dataSizeTotal, 0, GL_STATIC_DRAW);
-    {
-      uint32_t bufferPos{0};
-      for (Model model : models) {
-        uint32_t dataSize = model.indices.size() * sizeof(uint32_t);
-        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, bufferPos, dataSize,
-            model.indices.data());
-        handles[model.name] = MeshHandle(bufferPos, model.indices.size(),
-            model.isOrthogonal);
-        bufferPos += dataSize;
+    uint64_t seenGeneration{0};
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [this, &seenGeneration]() { 
+          return stop || generation != seenGeneration; });
+      if (stop) {
+        return;
+      }
+      seenGeneration = generation;
+      lock.unlock();
+      (*task)(a_index);
+      lock.lock();
+      if (--pending == 0) {
+        done.notify_one();
       }
     }
   }
-  
-  for (auto model : models) {
-    if (!model.textureFilename.empty()) {
-      int32_t w;
-      int32_t h;
-      int32_t c;
-      stbi_uc *tex = stbi_load(model.textureFilename.c_str(), &w, &h, &c,
-          STBI_rgb_alpha);
 
-      glGenTextures(1, &handles[model.name].textureId);
-      glBindTexture(GL_TEXTURE_2D, handles[model.name].textureId);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA,
-          GL_UNSIGNED_BYTE, reinterpret_cast<void *>(tex));
-
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+  std::vector<std::thread> threads;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable done;
+  std::function<void(uint32_t)> const *task;
+  uint64_t generation;
+  uint32_t pending;
+  bool stop;
+};
 
-      glBindTexture(GL_TEXTURE_2D, 0);
-    
-      stbi_image_free(tex);
+// Extracts the six planes of the view frustum from a view-projection matrix,
+// normalised and with normals pointing into the frustum.
+static void extractFrustumPlanes(glm::mat4 const &m, glm::vec4 *planes) {
+  for (int32_t i{0}; i < 3; i++) {
+    for (int32_t j{0}; j < 2; j++) {
+      float const sign = (j == 0) ? 1.0f : -1.0f;
+      glm::vec4 plane(m[0][3] + sign * m[0][i], m[1][3] + sign * m[1][i],
+          m[2][3] + sign * m[2][i], m[3][3] + sign * m[3][i]);
+      planes[2 * i + j] = plane * (1.0f / glm::length(glm::vec3(plane)));
     }
   }
+}
 
-  {
-    uint32_t stride = sizeof(Vertex);
-    uint32_t firstVertexOffset{0};
-    for (Model model : models) {
-      GLuint vao;
-      glGenVertexArrays(1, &vao);
-      glBindVertexArray(vao);
-
-      glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
-      
-      glEnableVertexAttribArray(0);
-      glEnableVertexAttribArray(1);
-      glEnableVertexAttribArray(2);
-
-      glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 
-          reinterpret_cast<void *>(firstVertexOffset));
-      glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, 
-          reinterpret_cast<void *>(firstVertexOffset + 3 * sizeof(float)));
-      glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, 
-          reinterpret_cast<void *>(firstVertexOffset + 6 * sizeof(float)));
-
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
-      firstVertexOffset += 8 * model.vertices.size() * sizeof(float);
-      handles[model.name].vao = vao;
+static bool isSphereInFrustum(glm::vec4 const *planes, glm::vec3 center,
+    float radius) {
+  for (uint32_t i{0}; i < 6; i++) {
+    if (glm::dot(glm::vec3(planes[i]), center) + planes[i].w < -radius) {
+      return false;
     }
   }
-
-  return handles;
+  return true;
 }
 
-GLuint buildShaders(std::string const &vertexShaderGlsl,
-    std::string const &fragmentShaderGlsl) {
-  GLuint vertShaderId = glCreateShader(GL_VERTEX_SHADER);
-  {
+// Returns 0 if the box is outside the frustum, 2 if it is fully inside, and 1
+// otherwise.
+static uint32_t testBoxInFrustum(glm::vec4 const *planes, glm::vec3 boxMin,
+    glm::vec3 boxMax) {
+  uint32_t result{2};
+  for (uint32_t i{0}; i < 6; i++) {
+    glm::vec3 const normal(planes[i]);
+    glm::vec3 const pMax(normal.x > 0.0f ? boxMax.x : boxMin.x,
+        normal.y > 0.0f ? boxMax.y : boxMin.y,
+        normal.z > 0.0f ? boxMax.z : boxMin.z);
+    if (glm::dot(normal, pMax) + planes[i].w < 0.0f) {
+      return 0;
+    }
+    glm::vec3 const pMin(normal.x > 0.0f ? boxMin.x : boxMax.x,
+        normal.y > 0.0f ? boxMin.y : boxMax.y,
+        normal.z > 0.0f ? boxMin.z : boxMax.z);
+    if (glm::dot(normal, pMin) + planes[i].w < 0.0f) {
+      result = 1;
+    }
+  }
+  return result;
+}
 
-    char const *vertSourcePtr = vertexShaderGlsl.c_str();
-    glShaderSource(vertShaderId, 1, &vertSourcePtr, nullptr);
-    glCompileShader(vertShaderId);
+static uint32_t internMeshName(std::map<std::string, uint32_t> &meshIds,
+    std::string const &name) {
+  auto it = meshIds.find(name);
+  if (it == meshIds.end()) {
+    uint32_t const meshId = static_cast<uint32_t>(meshIds.size());
+    meshIds[name] = meshId;
+    return meshId;
+  }
+  return it->second;
+}
 
-    int32_t infoLogLen;
-    GLint res = GL_FALSE;
+static bool isExtensionSupported(char const *extList, char const *extension) {
+  char const *where = strchr(extension, ' ');
+  if (where || *extension == '\0') {
+    return false;
+  }
+  for (char const *start = extList;;) {
+    where = strstr(start, extension);
+    if (!where) {
+      break;
+    }
+    char const *terminator = where + strlen(extension);
+    if (where == start || *(where - 1) == ' ') {
+      if (*terminator == ' ' || *terminator == '\0') {
+        return true;
+      }
+    }
+    start = terminator;
+  }
+  return false;
+}
+
+// The GL context is either created through GLX, with a window for the
+// preview, or through EGL without any display server. EGL is only available
+// when built with HAVE_EGL.
+struct GlContext {
+  Display *display;
+  Window win;
+  Colormap cmap;
+  GLXContext glxContext;
+#if defined(HAVE_EGL)
+  EGLDisplay eglDisplay;
+  EGLSurface eglSurface;
+  EGLContext eglContext;
+#endif
+  bool isEgl;
+
+  GlContext():
+    display(nullptr),
+    win(),
+    cmap(),
+    glxContext(),
+#if defined(HAVE_EGL)
+    eglDisplay(EGL_NO_DISPLAY),
+    eglSurface(EGL_NO_SURFACE),
+    eglContext(EGL_NO_CONTEXT),
+#endif
+    isEgl(false) {}
+};
+
+static bool ctxErrorOccurred = false;
+static int32_t ctxErrorHandler(Display *, XErrorEvent *) {
+  ctxErrorOccurred = true;
+  return 0;
+}
+
+// Simplifies a mesh by vertex clustering: vertices falling into the same cell
+// of a uniform grid are merged into their average, and triangles collapsing
+// in the process are dropped.
+static MeshGeometry simplifyMesh(std::vector<Vertex> const &vertices,
+    std::vector<uint32_t> const &indices, float cellSize) {
+  MeshGeometry simplified;
+  if (vertices.empty()) {
+    return simplified;
+  }
+
+  glm::vec3 origin = vertices[0].pos;
+  for (auto const &vertex : vertices) {
+    origin = glm::min(origin, vertex.pos);
+  }
+
+  std::unordered_map<uint64_t, uint32_t> clusters;
+  std::vector<uint32_t> clusterSizes;
+  std::vector<uint32_t> remap(vertices.size());
+  for (uint32_t i{0}; i < vertices.size(); i++) {
+    glm::vec3 const cell = glm::floor((vertices[i].pos - origin) / cellSize);
+    uint64_t const key = (static_cast<uint64_t>(cell.x) << 42)
+      | (static_cast<uint64_t>(cell.y) << 21) | static_cast<uint64_t>(cell.z);
+    auto it = clusters.find(key);
+    if (it == clusters.end()) {
+      uint32_t const cluster = static_cast<uint32_t>(clusterSizes.size());
+      clusters[key] = cluster;
+      clusterSizes.push_back(1);
+      simplified.vertices.push_back(vertices[i]);
+      remap[i] = cluster;
+    } else {
+      Vertex &merged = simplified.vertices[it->second];
+      merged.pos += vertices[i].pos;
+      merged.color += vertices[i].color;
+      clusterSizes[it->second]++;
+      remap[i] = it->second;
+    }
+  }
+  for (uint32_t i{0}; i < simplified.vertices.size(); i++) {
+    float const weight = 1.0f / static_cast<float>(clusterSizes[i]);
+    simplified.vertices[i].pos *= weight;
+    simplified.vertices[i].color *= weight;
+  }
+
+  for (uint32_t i{0}; i + 2 < indices.size(); i += 3) {
+    uint32_t const a = remap[indices[i]];
+    uint32_t const b = remap[indices[i + 1]];
+    uint32_t const c = remap[indices[i + 2]];
+    if (a != b && b != c && a != c) {
+      simplified.indices.push_back(a);
+      simplified.indices.push_back(b);
+      simplified.indices.push_back(c);
+    }
+  }
+  return simplified;
+}
+
+static GLuint createVertexArray(GLuint vertexBuffer, GLuint indexBuffer,
+    uint32_t firstVertexOffset) {
+  uint32_t stride = sizeof(Vertex);
+
+  GLuint vao;
+  glGenVertexArrays(1, &vao);
+  glBindVertexArray(vao);
+
+  glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+  
+  glEnableVertexAttribArray(0);
+  glEnableVertexAttribArray(1);
+  glEnableVertexAttribArray(2);
+  glEnableVertexAttribArray(4);
+
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 
+      reinterpret_cast<void *>(firstVertexOffset));
+  glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, 
+      reinterpret_cast<void *>(firstVertexOffset + 3 * sizeof(float)));
+  glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, stride, 
+      reinterpret_cast<void *>(firstVertexOffset + 6 * sizeof(float)));
+  glVertexAttribPointer(4, 1, GL_FLOAT, GL_FALSE, stride, 
+      reinterpret_cast<void *>(firstVertexOffset + 8 * sizeof(float)));
+
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, indexBuffer);
+  return vao;
+}
+
+// Halves the width and/or height of an RGBA image by averaging neighbouring
+// texels.
+static void halveImage(std::vector<uint8_t> &pixels, int32_t &w, int32_t &h,
+    bool halveWidth, bool halveHeight) {
+  int32_t const sx = halveWidth ? 2 : 1;
+  int32_t const sy = halveHeight ? 2 : 1;
+  int32_t const hw = w / sx;
+  int32_t const hh = h / sy;
+  std::vector<uint8_t> halved(static_cast<size_t>(4 * hw * hh));
+  for (int32_t y{0}; y < hh; y++) {
+    for (int32_t x{0}; x < hw; x++) {
+      for (int32_t c{0}; c < 4; c++) {
+        uint32_t sum{0};
+        for (int32_t dy{0}; dy < sy; dy++) {
+          for (int32_t dx{0}; dx < sx; dx++) {
+            sum += pixels[4 * ((y * sy + dy) * w + x * sx + dx) + c];
+          }
+        }
+        halved[4 * (y * hw + x) + c] = static_cast<uint8_t>(
+            (sum + (sx * sy) / 2) / (sx * sy));
+      }
+    }
+  }
+  pixels.swap(halved);
+  w = hw;
+  h = hh;
+}
+
+// Decodes a texture and halves it down to w x h texels. Returns no texels if
+// the texture could not be decoded.
+static std::vector<uint8_t> decodeTexture(std::string const &filename,
+    int32_t w, int32_t h) {
+  int32_t tw;
+  int32_t th;
+  int32_t tc;
+  stbi_uc *tex = stbi_load(filename.c_str(), &tw, &th, &tc, STBI_rgb_alpha);
+  if (tex == nullptr) {
+    return std::vector<uint8_t>();
+  }
+  std::vector<uint8_t> pixels(tex, tex + 4 * tw * th);
+  stbi_image_free(tex);
+  while (tw > w || th > h) {
+    halveImage(pixels, tw, th, tw > w, th > h);
+  }
+  return pixels;
+}
+
+static uint16_t packRgb565(int32_t const *rgb) {
+  return static_cast<uint16_t>(((rgb[0] * 31 + 127) / 255) << 11 
+      | ((rgb[1] * 63 + 127) / 255) << 5 | ((rgb[2] * 31 + 127) / 255));
+}
+
+static void unpackRgb565(uint16_t c, int32_t *rgb) {
+  int32_t const r = (c >> 11) & 31;
+  int32_t const g = (c >> 5) & 63;
+  int32_t const b = c & 31;
+  rgb[0] = (r << 3) | (r >> 2);
+  rgb[1] = (g << 2) | (g >> 4);
+  rgb[2] = (b << 3) | (b >> 2);
+}
+
+// Encodes the colours of 4x4 RGBA texels as a BC1 block, with endpoints on
+// the slightly inset bounding box of the colours.
+static void encodeColorBlock(uint8_t const *texels, uint8_t *out) {
+  int32_t lo[3] = {255, 255, 255};
+  int32_t hi[3] = {0, 0, 0};
+  for (uint32_t i{0}; i < 16; i++) {
+    for (uint32_t c{0}; c < 3; c++) {
+      lo[c] = std::min(lo[c], static_cast<int32_t>(texels[4 * i + c]));
+      hi[c] = std::max(hi[c], static_cast<int32_t>(texels[4 * i + c]));
+    }
+  }
+  for (uint32_t c{0}; c < 3; c++) {
+    int32_t const inset = (hi[c] - lo[c]) / 16;
+    lo[c] += inset;
+    hi[c] -= inset;
+  }
+  uint16_t c0 = packRgb565(hi);
+  uint16_t c1 = packRgb565(lo);
+  if (c0 < c1) {
+    std::swap(c0, c1);
+  }
+
+  int32_t palette[4][3];
+  unpackRgb565(c0, palette[0]);
+  unpackRgb565(c1, palette[1]);
+  for (uint32_t c{0}; c < 3; c++) {
+    palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+    palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+  }
+
+  uint32_t indices{0};
+  if (c0 != c1) {
+    for (uint32_t i{0}; i < 16; i++) {
+      uint32_t best{0};
+      int32_t bestDistance{std::numeric_limits<int32_t>::max()};
+      for (uint32_t p{0}; p < 4; p++) {
+        int32_t distance{0};
+        for (uint32_t c{0}; c < 3; c++) {
+          int32_t const d = static_cast<int32_t>(texels[4 * i + c]) 
+            - palette[p][c];
+          distance += d * d;
+        }
+        if (distance < bestDistance) {
+          best = p;
+          bestDistance = distance;
+        }
+      }
+      indices |= best << (2 * i);
+    }
+  }
+  out[0] = static_cast<uint8_t>(c0 & 0xff);
+  out[1] = static_cast<uint8_t>(c0 >> 8);
+  out[2] = static_cast<uint8_t>(c1 & 0xff);
+  out[3] = static_cast<uint8_t>(c1 >> 8);
+  for (uint32_t i{0}; i < 4; i++) {
+    out[4 + i] = static_cast<uint8_t>((indices >> (8 * i)) & 0xff);
+  }
+}
+
+// Encodes the alpha of 4x4 RGBA texels as the alpha half of a BC3 block,
+// interpolating eight values between the extremes.
+static void encodeAlphaBlock(uint8_t const *texels, uint8_t *out) {
+  int32_t a0{0};
+  int32_t a1{255};
+  for (uint32_t i{0}; i < 16; i++) {
+    a0 = std::max(a0, static_cast<int32_t>(texels[4 * i + 3]));
+    a1 = std::min(a1, static_cast<int32_t>(texels[4 * i + 3]));
+  }
+  int32_t palette[8] = {a0, a1, 0, 0, 0, 0, 0, 0};
+  for (int32_t p{2}; p < 8; p++) {
+    palette[p] = ((8 - p) * a0 + (p - 1) * a1) / 7;
+  }
+
+  uint64_t indices{0};
+  if (a0 != a1) {
+    for (uint32_t i{0}; i < 16; i++) {
+      uint64_t best{0};
+      int32_t bestDistance{256};
+      for (uint32_t p{0}; p < 8; p++) {
+        int32_t const distance = std::abs(
+            static_cast<int32_t>(texels[4 * i + 3]) - palette[p]);
+        if (distance < bestDistance) {
+          best = p;
+          bestDistance = distance;
+        }
+      }
+      indices |= best << (3 * i);
+    }
+  }
+  out[0] = static_cast<uint8_t>(a0);
+  out[1] = static_cast<uint8_t>(a1);
+  for (uint32_t i{0}; i < 6; i++) {
+    out[2 + i] = static_cast<uint8_t>((indices >> (8 * i)) & 0xff);
+  }
+}
+
+// Compresses an RGBA image and its full mip chain to BC1 if it is opaque, or
+// to BC3 if not. Blocks reaching past the edge of small mip levels repeat the
+// last row and column.
+static CompressedImage compressImage(std::vector<uint8_t> pixels, int32_t w,
+    int32_t h) {
+  bool isOpaque{true};
+  for (size_t i{3}; i < pixels.size(); i += 4) {
+    isOpaque = isOpaque && pixels[i] == 255;
+  }
+
+  CompressedImage image;
+  image.format = isOpaque ? GL_COMPRESSED_RGB_S3TC_DXT1_EXT 
+    : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+  image.width = w;
+  image.height = h;
+  uint32_t const blockSize = isOpaque ? 8 : 16;
+  while (true) {
+    int32_t const bw = (w + 3) / 4;
+    int32_t const bh = (h + 3) / 4;
+    std::vector<uint8_t> level(static_cast<size_t>(blockSize * bw * bh));
+    uint8_t texels[64];
+    for (int32_t by{0}; by < bh; by++) {
+      for (int32_t bx{0}; bx < bw; bx++) {
+        for (int32_t y{0}; y < 4; y++) {
+          for (int32_t x{0}; x < 4; x++) {
+            int32_t const sx = std::min(4 * bx + x, w - 1);
+            int32_t const sy = std::min(4 * by + y, h - 1);
+            memcpy(&texels[4 * (4 * y + x)], &pixels[4 * (sy * w + sx)], 4);
+          }
+        }
+        uint8_t *out = &level[blockSize * (by * bw + bx)];
+        if (!isOpaque) {
+          encodeAlphaBlock(texels, out);
+          out += 8;
+        }
+        encodeColorBlock(texels, out);
+      }
+    }
+    image.levels.push_back(level);
+    if (w == 1 && h == 1) {
+      break;
+    }
+    halveImage(pixels, w, h, w > 1, h > 1);
+  }
+  return image;
+}
+
+// The cache holds a small header followed by the size and data of each mip
+// level. It is stale once the source texture is modified, and rejected unless
+// it holds the full mip chain of an image of the expected size.
+static bool readCompressedImage(std::string const &cacheFilename,
+    std::string const &sourceFilename, int32_t w, int32_t h, 
+    CompressedImage &image) {
+  struct stat cacheStat;
+  struct stat sourceStat;
+  if (stat(cacheFilename.c_str(), &cacheStat) != 0 
+      || stat(sourceFilename.c_str(), &sourceStat) != 0 
+      || cacheStat.st_mtime < sourceStat.st_mtime) {
+    return false;
+  }
+  std::ifstream file(cacheFilename, std::ios::binary);
+  char magic[4];
+  uint32_t header[4];
+  file.read(magic, sizeof(magic));
+  file.read(reinterpret_cast<char *>(header), sizeof(header));
+  if (!file || strncmp(magic, "S3TC", 4) != 0
+      || (header[0] != GL_COMPRESSED_RGB_S3TC_DXT1_EXT 
+        && header[0] != GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+      || header[1] != static_cast<uint32_t>(w) 
+      || header[2] != static_cast<uint32_t>(h)) {
+    return false;
+  }
+  uint32_t const blockSize = 
+    (header[0] == GL_COMPRESSED_RGB_S3TC_DXT1_EXT) ? 8 : 16;
+  std::vector<uint32_t> levelSizes;
+  for (int32_t lw{w}, lh{h}; ; lw = std::max(1, lw / 2), 
+      lh = std::max(1, lh / 2)) {
+    levelSizes.push_back(blockSize * static_cast<uint32_t>(
+          ((lw + 3) / 4) * ((lh + 3) / 4)));
+    if (lw == 1 && lh == 1) {
+      break;
+    }
+  }
+  if (header[3] != levelSizes.size()) {
+    return false;
+  }
+  image.format = header[0];
+  image.width = w;
+  image.height = h;
+  image.levels.resize(levelSizes.size());
+  for (size_t i{0}; i < levelSizes.size(); i++) {
+    uint32_t size;
+    file.read(reinterpret_cast<char *>(&size), sizeof(size));
+    if (!file || size != levelSizes[i]) {
+      return false;
+    }
+    image.levels[i].resize(size);
+    file.read(reinterpret_cast<char *>(image.levels[i].data()), size);
+  }
+  return static_cast<bool>(file);
+}
+
+// The cache is written to a temporary file first and renamed into place, so
+// that other processes sharing the map never read a partially written cache.
+static bool writeCompressedImage(std::string const &cacheFilename,
+    CompressedImage const &image) {
+  std::string const temporaryFilename = cacheFilename + "." 
+    + std::to_string(getpid()) + ".tmp";
+  {
+    std::ofstream file(temporaryFilename, std::ios::binary);
+    uint32_t const header[4] = {image.format, 
+      static_cast<uint32_t>(image.width), static_cast<uint32_t>(image.height),
+      static_cast<uint32_t>(image.levels.size())};
+    file.write("S3TC", 4);
+    file.write(reinterpret_cast<char const *>(header), sizeof(header));
+    for (auto const &level : image.levels) {
+      uint32_t const size = static_cast<uint32_t>(level.size());
+      file.write(reinterpret_cast<char const *>(&size), sizeof(size));
+      file.write(reinterpret_cast<char const *>(level.data()), size);
+    }
+    file.close();
+    if (!file) {
+      remove(temporaryFilename.c_str());
+      return false;
+    }
+  }
+  if (rename(temporaryFilename.c_str(), cacheFilename.c_str()) != 0) {
+    remove(temporaryFilename.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Textures of the same size and format are packed as layers of shared texture
+// arrays, so that all meshes textured from one array are drawn without
+// rebinding and can be baked together. An array holds at most
+// GL_MAX_ARRAY_TEXTURE_LAYERS images. The demand of a texture is the number
+// of texels along each side the camera can resolve, or zero if unknown, and
+// textures are halved as long as they stay above it. Compressed textures are
+// read from a cache file next to the source image, named after the size they
+// were downscaled to, and written there first if missing or stale. Textures
+// whose sides are not multiples of four are left uncompressed. If
+// softwareTextures is given, it receives a copy of every uncompressed array,
+// keyed by texture id.
+std::map<std::string, TextureLayer> loadTextureArrays(
+    std::map<std::string, glm::vec2> const &textureDemands,
+    TextureOptions const &textureOptions,
+    std::map<GLuint, SoftwareTexture> *softwareTextures, bool verbose)
+{
+  bool const compress{textureOptions.compress 
+    && GLEW_EXT_texture_compression_s3tc};
+  if (textureOptions.compress && !compress) {
+    std::cerr << "S3TC texture compression is not supported, textures are "
+      << "loaded uncompressed" << std::endl;
+  }
+  bool const hasMipmaps{textureOptions.filter != "nearest"};
+  GLenum const minFilter = !hasMipmaps ? GL_NEAREST 
+    : (textureOptions.filter == "bilinear") ? GL_LINEAR_MIPMAP_NEAREST 
+    : GL_LINEAR_MIPMAP_LINEAR;
+  GLenum const magFilter = hasMipmaps ? GL_LINEAR : GL_NEAREST;
+
+  std::map<std::tuple<GLenum, int32_t, int32_t>, std::vector<std::string>> 
+    arrayGroups;
+  std::map<std::string, CompressedImage> compressedImages;
+  uint64_t fullSize{0};
+  uint64_t loadedSize{0};
+  uint32_t convertedCount{0};
+  for (auto const &textureDemand : textureDemands) {
+    std::string const &filename = textureDemand.first;
+    glm::vec2 const &demand = textureDemand.second;
+    int32_t w;
+    int32_t h;
+    int32_t c;
+    if (!stbi_info(filename.c_str(), &w, &h, &c)) {
+      std::cerr << "Could not load texture '" << filename << "'" << std::endl;
+      continue;
+    }
+    fullSize += 4 * static_cast<uint64_t>(w) * static_cast<uint64_t>(h);
+
+    int32_t const maxSize = (textureOptions.maxSize > 0) 
+      ? static_cast<int32_t>(textureOptions.maxSize) 
+      : std::numeric_limits<int32_t>::max();
+    while (w > 1 && (w > maxSize 
+          || (demand.x > 0.0f && static_cast<float>(w / 2) >= demand.x))) {
+      w /= 2;
+    }
+    while (h > 1 && (h > maxSize 
+          || (demand.y > 0.0f && static_cast<float>(h / 2) >= demand.y))) {
+      h /= 2;
+    }
+
+    GLenum format{GL_RGBA8};
+    if (compress && w % 4 == 0 && h % 4 == 0) {
+      std::string const cacheFilename = filename + "." + std::to_string(w) 
+        + "x" + std::to_string(h) + ".s3tc";
+      CompressedImage &image = compressedImages[filename];
+      if (!readCompressedImage(cacheFilename, filename, w, h, image)) {
+        std::vector<uint8_t> const pixels = decodeTexture(filename, w, h);
+        if (pixels.empty()) {
+          std::cerr << "Could not load texture '" << filename << "'" 
+            << std::endl;
+          compressedImages.erase(filename);
+          continue;
+        }
+        image = compressImage(pixels, w, h);
+        convertedCount++;
+        if (!writeCompressedImage(cacheFilename, image)) {
+          std::cerr << "Could not write texture cache '" << cacheFilename 
+            << "'" << std::endl;
+        }
+      }
+      format = image.format;
+      loadedSize += image.levels[0].size();
+    } else {
+      loadedSize += 4 * static_cast<uint64_t>(w) * static_cast<uint64_t>(h);
+    }
+    arrayGroups[std::make_tuple(format, w, h)].push_back(filename);
+  }
+
+  GLint maxLayers{256};
+  glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+
+  std::map<std::string, TextureLayer> textureLayers;
+  std::vector<std::string> failedTextures;
+  uint32_t arrayCount{0};
+  for (auto const &arrayGroup : arrayGroups) {
+    GLenum const format = std::get<0>(arrayGroup.first);
+    int32_t const w = std::get<1>(arrayGroup.first);
+    int32_t const h = std::get<2>(arrayGroup.first);
+    std::vector<std::string> const &group = arrayGroup.second;
+    for (size_t first{0}; first < group.size(); 
+        first += static_cast<size_t>(maxLayers)) {
+      int32_t const layerCount = static_cast<int32_t>(std::min(
+            group.size() - first, static_cast<size_t>(maxLayers)));
+
+      GLuint textureId;
+      glGenTextures(1, &textureId);
+      glBindTexture(GL_TEXTURE_2D_ARRAY, textureId);
+      if (format == GL_RGBA8) {
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_RGBA8, w, h, layerCount, 0,
+            GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        for (int32_t layer{0}; layer < layerCount; layer++) {
+          // A texture that fails to decode keeps its layer, blank, but is
+          // left out of the returned layers.
+          std::vector<uint8_t> pixels = decodeTexture(group[first + layer], 
+              w, h);
+          if (pixels.empty()) {
+            std::cerr << "Could not load texture '" << group[first + layer] 
+              << "'" << std::endl;
+            failedTextures.push_back(group[first + layer]);
+            pixels.resize(static_cast<size_t>(4 * w * h));
+          }
+          glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, w, h, 1,
+              GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+          bool isOpaque{true};
+          for (size_t i{3}; i < pixels.size(); i += 4) {
+            isOpaque = isOpaque && pixels[i] == 255;
+          }
+          textureLayers[group[first + layer]].isOpaque = isOpaque;
+          if (softwareTextures != nullptr) {
+            SoftwareTexture &softwareTexture = (*softwareTextures)[textureId];
+            softwareTexture.width = w;
+            softwareTexture.height = h;
+            softwareTexture.minFilter = minFilter;
+            softwareTexture.magFilter = magFilter;
+            softwareTexture.layers.push_back(pixels);
+            std::vector<uint8_t> &levels = softwareTexture.layers.back();
+            softwareTexture.levelOffsets.assign(1, 0);
+            std::vector<uint8_t> level = pixels;
+            int32_t lw{w};
+            int32_t lh{h};
+            while (hasMipmaps && (lw > 1 || lh > 1)) {
+              halveImage(level, lw, lh, lw > 1, lh > 1);
+              softwareTexture.levelOffsets.push_back(levels.size());
+              levels.insert(levels.end(), level.begin(), level.end());
+            }
+          }
+        }
+        if (hasMipmaps) {
+          glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+        }
+      } else {
+        uint32_t const levelCount = hasMipmaps ? static_cast<uint32_t>(
+            compressedImages[group[first]].levels.size()) : 1;
+        for (uint32_t level{0}; level < levelCount; level++) {
+          GLsizei const levelSize = static_cast<GLsizei>(
+              compressedImages[group[first]].levels[level].size());
+          glCompressedTexImage3D(GL_TEXTURE_2D_ARRAY, level, format, 
+              std::max(1, w >> level), std::max(1, h >> level), layerCount, 0,
+              levelSize * layerCount, nullptr);
+          for (int32_t layer{0}; layer < layerCount; layer++) {
+            std::vector<uint8_t> const &data = 
+              compressedImages[group[first + layer]].levels[level];
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+                std::max(1, w >> level), std::max(1, h >> level), 1, format, 
+                static_cast<GLsizei>(data.size()), data.data());
+          }
+        }
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 
+            static_cast<GLint>(levelCount - 1));
+      }
+      for (int32_t layer{0}; layer < layerCount; layer++) {
+        std::string const &filename = group[first + layer];
+        textureLayers[filename].textureId = textureId;
+        textureLayers[filename].layer = static_cast<uint32_t>(layer);
+        if (format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) {
+          textureLayers[filename].isOpaque = false;
+        }
+      }
+
+      glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, minFilter);
+      glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, magFilter);
+      if (textureOptions.filter == "anisotropic" 
+          && GLEW_EXT_texture_filter_anisotropic) {
+        float maxAnisotropy{1.0f};
+        glGetFloatv(GL_MAX_TEXTURE_MAX_ANISOTROPY_EXT, &maxAnisotropy);
+        glTexParameterf(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_ANISOTROPY_EXT, 
+            std::min(textureOptions.anisotropy, maxAnisotropy));
+      }
+      arrayCount++;
+    }
+  }
+  glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+  for (auto const &filename : failedTextures) {
+    textureLayers.erase(filename);
+  }
+
+  if (verbose) {
+    std::clog << "Packed " << textureLayers.size() << " textures into " 
+      << arrayCount << " texture arrays" << std::endl;
+    if (compress) {
+      std::clog << "Compressed " << compressedImages.size() << " textures, " 
+        << convertedCount << " of them converted and cached now" << std::endl;
+    }
+    // Mip chains add another third to every texture.
+    float const mipFactor = hasMipmaps ? 4.0f / 3.0f : 1.0f;
+    std::clog << "Texture memory is " 
+      << mipFactor * static_cast<float>(loadedSize) / 1048576.0f 
+      << " MiB, downscaling and compression saved " 
+      << mipFactor * static_cast<float>(fullSize - loadedSize) / 1048576.0f
+      << " MiB" << std::endl;
+  }
+  return textureLayers;
+}
+
+// If meshGeometry is given, it receives a copy of the vertices and indices of
+// every mesh, indexed by mesh id, and softwareTextures a copy of the textures.
+// Up to lodLevels simplified levels of detail are generated for every OBJ
+// model, clustering vertices on grids of 32, 16 and 8 cells across the model.
+// A level is only kept if it removes at least a quarter of the triangles of
+// the previous one. The handles of these levels follow the ones in meshIds.
+std::vector<MeshHandle> loadModels(std::vector<ModelInfo> modelInfo,
+    std::vector<BlockInfo> blockInfo, 
+    std::map<std::string, uint32_t> const &meshIds, GLuint const *vbo,
+    uint32_t lodLevels, TextureOptions const &textureOptions,
+    std::vector<MeshGeometry> *meshGeometry,
+    std::map<GLuint, SoftwareTexture> *softwareTextures, bool verbose)
+{
+  struct Model {
+    std::vector<Vertex> vertices;
+    std::vector<uint32_t> indices;
+    std::string name;
+    std::string textureFilename;
+    glm::vec2 textureDemand;
+    uint32_t meshId;
+    uint32_t baseMeshId;
+    float lodCellSize;
+    bool isOrthogonal;
+
+    Model(std::string const &a_name, uint32_t a_meshId):
+      vertices(), 
+      indices(), 
+      name(a_name),
+      textureFilename(),
+      textureDemand(),
+      meshId(a_meshId),
+      baseMeshId(a_meshId),
+      lodCellSize(),
+      isOrthogonal(false) {}
+  };
+
+  std::vector<Model> models;
+  std::vector<Model> lodModels;
+
+  for (auto info : modelInfo) {
+    Model model(info.name, meshIds.at(info.name));
+    model.textureFilename = info.textureFilename;
+
+    if (verbose) {
+      std::cout << "Loading model '" << info.name << "'" << std::endl;
+    }
+
+    tinyobj::attrib_t attrib;
+    std::vector<tinyobj::shape_t> shapes;
+    std::vector<tinyobj::material_t> materials;
+    std::string warn, err;
+
+    if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &warn, &err, 
+          info.modelFilename.c_str())) {
+        throw std::runtime_error(warn + err);
+    }
+
+    std::unordered_map<Vertex, uint32_t> uniqueVertices = {};
+
+    for (auto const &shape : shapes) {
+      for (auto const &index : shape.mesh.indices) {
+        Vertex vertex = {};
+
+        vertex.pos = {
+          attrib.vertices[3 * index.vertex_index + 0],
+          attrib.vertices[3 * index.vertex_index + 1],
+          attrib.vertices[3 * index.vertex_index + 2]
+        };
+
+        if (attrib.texcoords.size() > 0) {
+          vertex.texCoord = {
+            attrib.texcoords[2 * index.texcoord_index + 0],
+            1.0f - attrib.texcoords[2 * index.texcoord_index + 1]
+          };
+        }
+
+        vertex.color = info.color;
+
+        if (uniqueVertices.count(vertex) == 0) {
+          uniqueVertices[vertex] = static_cast<uint32_t>(model.vertices.size());
+          model.vertices.push_back(vertex);
+        }
+
+        model.indices.push_back(uniqueVertices[vertex]);
+      }
+    }
+
+    if (!model.vertices.empty()) {
+      glm::vec3 boundsMin = model.vertices[0].pos;
+      glm::vec3 boundsMax = model.vertices[0].pos;
+      for (auto const &vertex : model.vertices) {
+        boundsMin = glm::min(boundsMin, vertex.pos);
+        boundsMax = glm::max(boundsMax, vertex.pos);
+      }
+      glm::vec3 const extent = boundsMax - boundsMin;
+      float const size = std::max(extent.x, std::max(extent.y, extent.z));
+
+      // Texture coordinates of a model are assumed to span it once.
+      model.textureDemand = glm::vec2(size * textureOptions.texelsPerMeter);
+
+      size_t previousIndexCount = model.indices.size();
+      for (uint32_t level{1}; level <= std::min(lodLevels, 3u); level++) {
+        float const cellSize = size / static_cast<float>(64 >> level);
+        MeshGeometry simplified = simplifyMesh(model.vertices, model.indices,
+            cellSize);
+        if (simplified.indices.empty() 
+            || 4 * simplified.indices.size() > 3 * previousIndexCount) {
+          break;
+        }
+        Model lodModel(info.name, 
+            static_cast<uint32_t>(meshIds.size() + lodModels.size()));
+        lodModel.textureFilename = model.textureFilename;
+        lodModel.textureDemand = model.textureDemand;
+        lodModel.vertices = simplified.vertices;
+        lodModel.indices = simplified.indices;
+        lodModel.baseMeshId = model.meshId;
+        lodModel.lodCellSize = cellSize;
+        lodModels.push_back(lodModel);
+        previousIndexCount = lodModel.indices.size();
+
+        if (verbose) {
+          std::cout << "Generated level of detail " << level << " for '" 
+            << info.name << "' (" << lodModel.indices.size() / 3 << " of " 
+            << model.indices.size() / 3 << " triangles)" << std::endl;
+        }
+      }
+    }
+    models.push_back(model);
+  }
+
+  for (auto info : blockInfo) {
+    Model model(info.name, meshIds.at(info.name));
+    model.textureFilename = info.textureFilename;
+
+    if (verbose) {
+      if (!info.isOrthogonal) {
+        std::cout << "Generating box '" << info.name << "'" << std::endl;
+      } else {
+        std::cout << "Generating overlay '" << info.name << "'" << std::endl;
+      }
+    }
+
+    float const xh = info.dimension.x / 2.0f;
+    float const yh = info.dimension.y / 2.0f;
+    float const zh = info.dimension.z / 2.0f;
+    float xtw = info.dimension.x / info.textureSize.x;
+    float ytw = info.dimension.y / info.textureSize.x;
+    float yth = info.dimension.y / info.textureSize.y;
+    float zth = info.dimension.z / info.textureSize.y;
+    if (info.textureFilename.empty()) {
+      xtw = 0.0f;
+      ytw = 0.0f;
+      yth = 0.0f;
+      zth = 0.0f;
+    }
+    if (info.isOrthogonal) {
+      xtw = -1.0f;
+      ytw = -1.0f;
+      yth = -1.0f;
+      zth = -1.0f;
+    }
+
+    model.vertices.push_back({{-xh, -yh, -zh}, {0.0f, 0.0f}, info.color});
+    model.vertices.push_back({{xh, -yh, -zh}, {xtw, 0.0f}, info.color});
+    model.vertices.push_back({{xh, yh, -zh}, {xtw, yth}, info.color});
+    model.vertices.push_back({{-xh, yh, -zh}, {0, yth}, info.color});
+
+    model.vertices.push_back({{-xh, -yh, zh}, {0.0f, 0.0f}, info.color});
+    model.vertices.push_back({{xh, -yh, zh}, {xtw, 0.0f}, info.color});
+    model.vertices.push_back({{xh, yh, zh}, {xtw, yth}, info.color});
+    model.vertices.push_back({{-xh, yh, zh}, {0, yth}, info.color});
+    
+    model.vertices.push_back({{-xh, -yh, -zh}, {0.0f, 0.0f}, info.color});
+    model.vertices.push_back({{xh, -yh, -zh}, {xtw, 0.0f}, info.color});
+    model.vertices.push_back({{xh, -yh, zh}, {xtw, zth}, info.color});
+    model.vertices.push_back({{-xh, -yh, zh}, {0, zth}, info.color});
+    
+    model.vertices.push_back({{-xh, yh, -zh}, {0.0f, 0.0f}, info.color});
+    model.vertices.push_back({{xh, yh, -zh}, {xtw, 0.0f}, info.color});
+    model.vertices.push_back({{xh, yh, zh}, {xtw, zth}, info.color});
+    model.vertices.push_back({{-xh, yh, zh}, {0, zth}, info.color});
+
+    model.vertices.push_back({{-xh, -yh, -zh}, {0.0f, 0.0f}, info.color});
+    model.vertices.push_back({{-xh, yh, -zh}, {ytw, 0.0f}, info.color});
+    model.vertices.push_back({{-xh, yh, zh}, {ytw, zth}, info.color});
+    model.vertices.push_back({{-xh, -yh, zh}, {0, zth}, info.color});
+    
+    model.vertices.push_back({{xh, -yh, -zh}, {0.0f, 0.0f}, info.color});
+    model.vertices.push_back({{xh, yh, -zh}, {ytw, 0.0f}, info.color});
+    model.vertices.push_back({{xh, yh, zh}, {ytw, zth}, info.color});
+    model.vertices.push_back({{xh, -yh, zh}, {0, zth}, info.color});
+
+    for (uint32_t i{0}; i <= 20; i = i + 4) {
+      model.indices.push_back(i);
+      model.indices.push_back(i + 1);
+      model.indices.push_back(i + 2);
+      model.indices.push_back(i);
+      model.indices.push_back(i + 2);
+      model.indices.push_back(i + 3);
+    }
+
+    model.isOrthogonal = info.isOrthogonal;
+    if (info.isOrthogonal) {
+      model.textureDemand = glm::vec2(info.dimension.x, info.dimension.y);
+    } else {
+      model.textureDemand = info.textureSize * textureOptions.texelsPerMeter;
+    }
+
+    models.push_back(model);
+  }
+  models.insert(models.end(), lodModels.begin(), lodModels.end());
+
+  std::map<std::string, glm::vec2> textureDemands;
+  for (auto const &model : models) {
+    if (!model.textureFilename.empty()) {
+      glm::vec2 &demand = textureDemands[model.textureFilename];
+      demand = glm::max(demand, model.textureDemand);
+    }
+  }
+  std::map<std::string, TextureLayer> const textureLayers = loadTextureArrays(
+      textureDemands, textureOptions, softwareTextures, verbose);
+  for (auto &model : models) {
+    auto it = textureLayers.find(model.textureFilename);
+    if (it != textureLayers.end()) {
+      for (auto &vertex : model.vertices) {
+        vertex.layer = static_cast<float>(it->second.layer);
+      }
+    }
+  }
+
+  uint32_t vertexCount{0};
+  uint32_t indexCount{0};
+  for (Model model : models) {
+    vertexCount += model.vertices.size();
+    indexCount += model.indices.size();
+  }
+  
+  {
+    uint32_t dataSizeTotal = vertexCount * sizeof(Vertex);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+    glBufferData(GL_ARRAY_BUFFER, dataSizeTotal, 0, GL_STATIC_DRAW);
+    {
+      uint32_t bufferPos{0};
+      for (Model model : models) {
+        uint32_t dataSize = model.vertices.size() * sizeof(Vertex);
+        glBufferSubData(GL_ARRAY_BUFFER, bufferPos, dataSize,
+            model.vertices.data());
+        bufferPos += dataSize;
+      }
+    }
+  }
+
+  std::vector<MeshHandle> handles(meshIds.size() + lodModels.size());
+  {
+    uint32_t dataSizeTotal = indexCount * sizeof(uint32_t);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, vbo[1]);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, dataSizeTotal, 0, GL_STATIC_DRAW);
+    {
+      uint32_t bufferPos{0};
+      for (Model model : models) {
+        uint32_t dataSize = model.indices.size() * sizeof(uint32_t);
+        glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, bufferPos, dataSize,
+            model.indices.data());
+        MeshHandle &handle = handles[model.meshId];
+        handle = MeshHandle(bufferPos, model.indices.size(),
+            model.isOrthogonal);
+        if (!model.vertices.empty()) {
+          handle.boundsMin = model.vertices[0].pos;
+          handle.boundsMax = model.vertices[0].pos;
+          for (auto const &vertex : model.vertices) {
+            handle.boundsMin = glm::min(handle.boundsMin, vertex.pos);
+            handle.boundsMax = glm::max(handle.boundsMax, vertex.pos);
+          }
+          handle.boundingCenter = glm::vec3(0.0f, 0.0f, 
+              0.5f * (handle.boundsMin.z + handle.boundsMax.z));
+          for (auto const &vertex : model.vertices) {
+            handle.boundingRadius = std::max(handle.boundingRadius,
+                glm::distance(vertex.pos, handle.boundingCenter));
+          }
+        }
+        bufferPos += dataSize;
+      }
+    }
+  }
+  
+  for (auto const &model : models) {
+    auto it = textureLayers.find(model.textureFilename);
+    if (it != textureLayers.end()) {
+      handles[model.meshId].textureId = it->second.textureId;
+      handles[model.meshId].isTransparent = !it->second.isOpaque;
+    }
+  }
+
+  for (auto const &lodModel : lodModels) {
+    MeshHandle &base = handles[lodModel.baseMeshId];
+    MeshHandle &lod = handles[lodModel.meshId];
+    if (base.lodCount == 0) {
+      base.firstLodMeshId = lodModel.meshId;
+    }
+    base.lodCount++;
+    lod.textureId = base.textureId;
+    lod.isTransparent = base.isTransparent;
+    lod.lodCellSize = lodModel.lodCellSize;
+    lod.boundsMin = base.boundsMin;
+    lod.boundsMax = base.boundsMax;
+    lod.boundingCenter = base.boundingCenter;
+    lod.boundingRadius = base.boundingRadius;
+  }
+
+  {
+    uint32_t firstVertexOffset{0};
+    for (Model model : models) {
+      handles[model.meshId].vao = createVertexArray(vbo[0], vbo[1],
+          firstVertexOffset);
+      firstVertexOffset += model.vertices.size() * sizeof(Vertex);
+    }
+    glBindVertexArray(0);
+  }
+
+  if (meshGeometry != nullptr) {
+    meshGeometry->resize(handles.size());
+    for (auto const &model : models) {
+      MeshGeometry &geometry = (*meshGeometry)[model.meshId];
+      geometry.vertices = model.vertices;
+      geometry.indices = model.indices;
+    }
+  }
+
+  return handles;
+}
+
+// Merges every static model and block instance into world space geometry, one
+// mesh per texture array, so that static scenery is drawn with a handful of
+// draw calls. Each baked mesh is drawn as a single instance at the origin whose
+// rotation cancels the one applied in the vertex shader. Overlays,
+// transparent meshes and frame instances are left as they are. The geometry
+// of the baked meshes is appended to meshGeometry.
+void bakeStaticInstances(std::vector<MeshHandle> &handles,
+    std::vector<MeshGeometry> &meshGeometry,
+    MeshInstances &meshInstances, std::map<std::string, uint32_t> &meshIds,
+    GLuint const *bakedVbo, bool verbose)
+{
+  std::map<GLuint, MeshGeometry> bakedGeometry;
+  MeshInstances remainingInstances;
+  uint32_t bakedInstanceCount{0};
+  for (uint32_t i{0}; i < meshInstances.size(); i++) {
+    uint32_t const meshId = meshInstances.meshId[i];
+    MeshHandle const &handle = handles[meshId];
+    if (handle.isOrthogonal || handle.isTransparent || handle.indexCount == 0) {
+      remainingInstances.add(meshId, meshInstances.position[i], 
+          meshInstances.rotation[i], meshInstances.visible[i] != 0);
+      continue;
+    }
+
+    MeshGeometry const &source = meshGeometry[meshId];
+    MeshGeometry &target = bakedGeometry[handle.textureId];
+    uint32_t const firstVertex = static_cast<uint32_t>(target.vertices.size());
+    float const a = glm::pi<float>() - meshInstances.rotation[i];
+    float const c = std::cos(a);
+    float const s = std::sin(a);
+    glm::vec3 const &p = meshInstances.position[i];
+    for (Vertex vertex : source.vertices) {
+      vertex.pos = glm::vec3(c * vertex.pos.x - s * vertex.pos.y + p.x, 
+          s * vertex.pos.x + c * vertex.pos.y + p.y, vertex.pos.z + p.z);
+      target.vertices.push_back(vertex);
+    }
+    for (uint32_t index : source.indices) {
+      target.indices.push_back(firstVertex + index);
+    }
+    bakedInstanceCount++;
+  }
+
+  uint32_t vertexCount{0};
+  uint32_t indexCount{0};
+  for (auto const &baked : bakedGeometry) {
+    vertexCount += baked.second.vertices.size();
+    indexCount += baked.second.indices.size();
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, bakedVbo[0]);
+  glBufferData(GL_ARRAY_BUFFER, vertexCount * sizeof(Vertex), 0, 
+      GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bakedVbo[1]);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCount * sizeof(uint32_t), 0,
+      GL_STATIC_DRAW);
+
+  uint32_t vertexPos{0};
+  uint32_t indexPos{0};
+  for (auto const &baked : bakedGeometry) {
+    MeshGeometry const &geometry = baked.second;
+    uint32_t const vertexSize = geometry.vertices.size() * sizeof(Vertex);
+    uint32_t const indexSize = geometry.indices.size() * sizeof(uint32_t);
+    glBindBuffer(GL_ARRAY_BUFFER, bakedVbo[0]);
+    glBufferSubData(GL_ARRAY_BUFFER, vertexPos, vertexSize, 
+        geometry.vertices.data());
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bakedVbo[1]);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, indexPos, indexSize,
+        geometry.indices.data());
+
+    MeshHandle handle(indexPos, geometry.indices.size(), false);
+    handle.textureId = baked.first;
+    handle.vao = createVertexArray(bakedVbo[0], bakedVbo[1], vertexPos);
+    handle.boundsMin = geometry.vertices[0].pos;
+    handle.boundsMax = geometry.vertices[0].pos;
+    for (auto const &vertex : geometry.vertices) {
+      handle.boundsMin = glm::min(handle.boundsMin, vertex.pos);
+      handle.boundsMax = glm::max(handle.boundsMax, vertex.pos);
+    }
+    handle.boundingCenter = 0.5f * (handle.boundsMin + handle.boundsMax);
+    handle.boundingRadius = 0.5f * glm::length(handle.boundsMax 
+        - handle.boundsMin);
+
+    uint32_t const meshId = static_cast<uint32_t>(handles.size());
+    handles.push_back(handle);
+    meshGeometry.resize(handles.size());
+    meshGeometry[meshId] = geometry;
+    meshIds["<baked " + std::to_string(baked.first) + ">"] = meshId;
+    remainingInstances.add(meshId, glm::vec3(0.0f, 0.0f, 0.0f), 
+        glm::pi<float>(), true);
+
+    vertexPos += vertexSize;
+    indexPos += indexSize;
+  }
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  meshInstances = remainingInstances;
+
+  if (verbose) {
+    std::clog << "Baked " << bakedInstanceCount << " static instances into " 
+      << bakedGeometry.size() << " meshes (" << vertexCount << " vertices, " 
+      << indexCount / 3 << " triangles)" << std::endl;
+  }
+}
+
+// Reserves one range per mesh in the per-instance attribute buffer, large
+// enough for all of its static instances and the instances that follow a
+// frame. Levels of detail get as much room as the mesh they simplify. The
+// instances that survive culling are written into these ranges every frame.
+// Each instance is stored as (x, y, z, rotation) and expanded into a model
+// transform in the vertex shader.
+void loadInstances(std::vector<MeshHandle> &handles,
+    MeshInstances const &meshInstances,
+    MeshInstances const &meshInstancesFrame,
+    std::map<std::string, uint32_t> const &meshIds, GLuint instanceVbo,
+    std::vector<glm::vec4> &instanceData, bool verbose)
+{
+  for (uint32_t i{0}; i < meshInstances.size(); i++) {
+    handles[meshInstances.meshId[i]].staticInstanceCount++;
+  }
+  for (uint32_t i{0}; i < meshInstancesFrame.size(); i++) {
+    handles[meshInstancesFrame.meshId[i]].dynamicInstanceSlots++;
+  }
+
+  for (auto &handle : handles) {
+    handle.instanceCapacity = handle.staticInstanceCount 
+      + handle.dynamicInstanceSlots;
+  }
+  for (auto &handle : handles) {
+    for (uint32_t i{0}; i < handle.lodCount; i++) {
+      handles[handle.firstLodMeshId + i].instanceCapacity = 
+        handle.instanceCapacity;
+    }
+  }
+
+  uint32_t instanceCount{0};
+  for (auto &handle : handles) {
+    handle.instanceOffset = instanceCount;
+    instanceCount += handle.instanceCapacity;
+  }
+  instanceData.resize(instanceCount);
+
+  glBindBuffer(GL_ARRAY_BUFFER, instanceVbo);
+  glBufferData(GL_ARRAY_BUFFER, instanceCount * sizeof(glm::vec4), nullptr,
+      GL_STREAM_DRAW);
+
+  for (auto const &handle : handles) {
+    glBindVertexArray(handle.vao);
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(glm::vec4),
+        reinterpret_cast<void *>(handle.instanceOffset * sizeof(glm::vec4)));
+    glVertexAttribDivisor(3, 1);
+  }
+  if (verbose) {
+    for (auto const &meshId : meshIds) {
+      MeshHandle const &handle = handles[meshId.second];
+      std::clog << "Mesh '" << meshId.first << "' (id " << meshId.second 
+        << ") has " << handle.staticInstanceCount << " static and "
+        << handle.dynamicInstanceSlots << " frame instances" << std::endl;
+    }
+  }
+  glBindVertexArray(0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Textures and vertex arrays are ranked densely in order of appearance, so
+// that they fit in their fields of the draw key. Ranks past the end of a
+// field share its last value, which only costs the grouping of those draws.
+// Returns false if there are more meshes than the mesh id field can hold.
+bool assignDrawKeys(std::vector<MeshHandle> &handles)
+{
+  if (handles.size() > drawKeyMeshIdMask + 1) {
+    std::cerr << "Too many meshes (" << handles.size() << ") for the draw key"
+      << std::endl;
+    return false;
+  }
+  std::map<GLuint, uint64_t> textureRanks;
+  std::map<GLuint, uint64_t> vaoRanks;
+  for (uint32_t meshId{0}; meshId < handles.size(); meshId++) {
+    MeshHandle &handle = handles[meshId];
+    uint64_t const pass = handle.isOrthogonal ? drawPassOverlay 
+      : (handle.isTransparent ? drawPassTransparent : drawPassOpaque);
+    if (textureRanks.count(handle.textureId) == 0) {
+      uint64_t const rank = std::min(drawKeyTextureMask, 
+          static_cast<uint64_t>(textureRanks.size()));
+      textureRanks[handle.textureId] = rank;
+    }
+    if (vaoRanks.count(handle.vao) == 0) {
+      uint64_t const rank = std::min(drawKeyVaoMask, 
+          static_cast<uint64_t>(vaoRanks.size()));
+      vaoRanks[handle.vao] = rank;
+    }
+    handle.drawKey = (pass << drawKeyPassShift) 
+      | (textureRanks[handle.textureId] << drawKeyTextureShift)
+      | (vaoRanks[handle.vao] << drawKeyVaoShift) 
+      | meshId;
+  }
+  return true;
+}
+
+// The cell size is chosen from the map extent so that cells hold a handful of
+// instances each on average.
+InstanceGrid buildInstanceGrid(MeshInstances const &meshInstances,
+    std::vector<MeshHandle> const &handles, bool verbose)
+{
+  uint32_t const instancesPerCell{8};
+
+  InstanceGrid grid;
+  std::vector<uint32_t> indexed;
+  glm::vec2 extentMin(0.0f, 0.0f);
+  glm::vec2 extentMax(0.0f, 0.0f);
+  for (uint32_t i{0}; i < meshInstances.size(); i++) {
+    MeshHandle const &handle = handles[meshInstances.meshId[i]];
+    if (handle.isOrthogonal) {
+      grid.unindexedInstances.push_back(i);
+      continue;
+    }
+    glm::vec2 const p(meshInstances.position[i].x, 
+        meshInstances.position[i].y);
+    if (indexed.empty()) {
+      extentMin = p;
+      extentMax = p;
+    }
+    extentMin = glm::min(extentMin, p);
+    extentMax = glm::max(extentMax, p);
+    indexed.push_back(i);
+  }
+
+  glm::vec2 const extent = extentMax - extentMin;
+  float const area = std::max(extent.x * extent.y, 1.0f);
+  grid.cellSize = std::max(1.0f, std::sqrt(area * instancesPerCell 
+        / std::max(static_cast<float>(indexed.size()), 1.0f)));
+  grid.origin = extentMin;
+  grid.columns = static_cast<uint32_t>(extent.x / grid.cellSize) + 1;
+  grid.rows = static_cast<uint32_t>(extent.y / grid.cellSize) + 1;
+
+  uint32_t const cellCount = grid.columns * grid.rows;
+  std::vector<uint32_t> instanceCell(meshInstances.size());
+  grid.cellStart.assign(cellCount + 1, 0);
+  grid.cellMin.assign(cellCount, glm::vec3(0.0f, 0.0f, 0.0f));
+  grid.cellMax.assign(cellCount, glm::vec3(0.0f, 0.0f, 0.0f));
+  for (uint32_t i : indexed) {
+    MeshHandle const &handle = handles[meshInstances.meshId[i]];
+    if (handle.boundingRadius > 2.0f * grid.cellSize) {
+      grid.unindexedInstances.push_back(i);
+      continue;
+    }
+    glm::vec3 const &p = meshInstances.position[i];
+    uint32_t const column = static_cast<uint32_t>(
+        (p.x - grid.origin.x) / grid.cellSize);
+    uint32_t const row = static_cast<uint32_t>(
+        (p.y - grid.origin.y) / grid.cellSize);
+    uint32_t const cell = row * grid.columns + column;
+    instanceCell[i] = cell;
+
+    glm::vec3 const center = p + handle.boundingCenter;
+    glm::vec3 const radius(handle.boundingRadius);
+    if (grid.cellStart[cell + 1] == 0) {
+      grid.cellMin[cell] = center - radius;
+      grid.cellMax[cell] = center + radius;
+    }
+    grid.cellMin[cell] = glm::min(grid.cellMin[cell], center - radius);
+    grid.cellMax[cell] = glm::max(grid.cellMax[cell], center + radius);
+    grid.cellStart[cell + 1]++;
+    grid.maxRadius = std::max(grid.maxRadius, handle.boundingRadius);
+  }
+  for (uint32_t cell{0}; cell < cellCount; cell++) {
+    grid.cellStart[cell + 1] += grid.cellStart[cell];
+  }
+
+  grid.cellInstances.resize(grid.cellStart[cellCount]);
+  std::vector<uint32_t> written(grid.cellStart.begin(), 
+      grid.cellStart.end() - 1);
+  for (uint32_t i : indexed) {
+    if (handles[meshInstances.meshId[i]].boundingRadius 
+        <= 2.0f * grid.cellSize) {
+      grid.cellInstances[written[instanceCell[i]]++] = i;
+    }
+  }
+
+  if (verbose) {
+    std::clog << "Indexed " << grid.cellInstances.size() 
+      << " static instances in a " << grid.columns << "x" << grid.rows 
+      << " grid of " << grid.cellSize << " m cells, " 
+      << grid.unindexedInstances.size() << " instances are not indexed" 
+      << std::endl;
+  }
+  return grid;
+}
+
+void publishImage(cluon::SharedMemory &sharedMemory, void const *data,
+    uint32_t size, cluon::data::TimeStamp const &sampleTimeStamp,
+    StreamCopier &streamCopier)
+{
+  sharedMemory.lock();
+  sharedMemory.setTimeStamp(sampleTimeStamp);
+  {
+    streamCopier.copy(sharedMemory.data(), data, size);
+  }
+  sharedMemory.unlock();
+  sharedMemory.notifyAll();
+}
+
+// Copies a finished readback from a pixel buffer object into shared memory.
+// The buffer is mapped before the shared memory is locked, so the lock is only
+// held while the pixels are streamed across. A persistently mapped buffer is
+// copied from directly, as its fence has already been waited for.
+void publishReadback(cluon::SharedMemory &sharedMemory, GLuint pbo,
+    void const *mappedData, uint32_t size,
+    cluon::data::TimeStamp const &sampleTimeStamp, StreamCopier &streamCopier)
+{
+  if (mappedData != nullptr) {
+    publishImage(sharedMemory, mappedData, size, sampleTimeStamp, 
+        streamCopier);
+    return;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+  void const *data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size,
+      GL_MAP_READ_BIT);
+  if (data != nullptr) {
+    publishImage(sharedMemory, data, size, sampleTimeStamp, streamCopier);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// Republishes the image already in shared memory under a new time stamp, for
+// ticks where the scene did not change.
+void republishTimeStamp(cluon::SharedMemory &sharedMemory,
+    cluon::data::TimeStamp const &sampleTimeStamp)
+{
+  sharedMemory.lock();
+  sharedMemory.setTimeStamp(sampleTimeStamp);
+  sharedMemory.unlock();
+  sharedMemory.notifyAll();
+}
+
+// Fetches the nearest texel of level 0 of a texture layer, repeating the
+// texture outside of [0, 1).
+static uint8_t const *sampleNearest(SoftwareTexture const &texture,
+    uint32_t layer, float u, float v)
+{
+  int32_t tx = static_cast<int32_t>(std::floor(u 
+        * static_cast<float>(texture.width))) % texture.width;
+  int32_t ty = static_cast<int32_t>(std::floor(v 
+        * static_cast<float>(texture.height))) % texture.height;
+  tx += (tx < 0) ? texture.width : 0;
+  ty += (ty < 0) ? texture.height : 0;
+  return &texture.layers[layer][4 * (ty * texture.width + tx)];
+}
+
+// Interpolates between the four texels of a mip level of a texture layer
+// nearest to (u, v), repeating the texture outside of [0, 1).
+static void sampleLinear(SoftwareTexture const &texture, uint32_t layer,
+    uint32_t level, float u, float v, float *rgba)
+{
+  int32_t const w = std::max(1, texture.width >> level);
+  int32_t const h = std::max(1, texture.height >> level);
+  uint8_t const *texels = 
+    &texture.layers[layer][texture.levelOffsets[level]];
+  float const x = u * static_cast<float>(w) - 0.5f;
+  float const y = v * static_cast<float>(h) - 0.5f;
+  float const fx = std::floor(x);
+  float const fy = std::floor(y);
+  float const ax = x - fx;
+  float const ay = y - fy;
+  int32_t const x0 = (static_cast<int32_t>(fx) % w + w) % w;
+  int32_t const y0 = (static_cast<int32_t>(fy) % h + h) % h;
+  int32_t const x1 = (x0 + 1) % w;
+  int32_t const y1 = (y0 + 1) % h;
+  for (uint32_t c{0}; c < 4; c++) {
+    float const top = static_cast<float>(texels[4 * (y0 * w + x0) + c]) 
+      * (1.0f - ax) + static_cast<float>(texels[4 * (y0 * w + x1) + c]) * ax;
+    float const bottom = static_cast<float>(texels[4 * (y1 * w + x0) + c]) 
+      * (1.0f - ax) + static_cast<float>(texels[4 * (y1 * w + x1) + c]) * ax;
+    rgba[c] = top * (1.0f - ay) + bottom * ay;
+  }
+}
+
+// Samples a texture layer with the filters of its GL texture, at a level of
+// detail given as log2 of the level 0 texels covered by a pixel. Anisotropic
+// filtering is approximated as trilinear.
+static void sampleTexture(SoftwareTexture const &texture, uint32_t layer,
+    float u, float v, float lod, uint8_t *rgba)
+{
+  GLenum const filter = (lod > 0.0f) ? texture.minFilter 
+    : texture.magFilter;
+  if (filter == GL_NEAREST) {
+    memcpy(rgba, sampleNearest(texture, layer, u, v), 4);
+    return;
+  }
+  float const maxLevel = static_cast<float>(texture.levelOffsets.size() - 1);
+  float level{0.0f};
+  if (filter == GL_LINEAR_MIPMAP_NEAREST) {
+    level = std::min(maxLevel, std::floor(lod + 0.5f));
+  } else if (filter == GL_LINEAR_MIPMAP_LINEAR) {
+    level = std::min(maxLevel, lod);
+  }
+  level = std::max(0.0f, level);
+  uint32_t const level0 = static_cast<uint32_t>(level);
+  float const blend = level - static_cast<float>(level0);
+  float color[4];
+  sampleLinear(texture, layer, level0, u, v, color);
+  if (blend > 0.0f) {
+    float color1[4];
+    sampleLinear(texture, layer, level0 + 1, u, v, color1);
+    for (uint32_t c{0}; c < 4; c++) {
+      color[c] += (color1[c] - color[c]) * blend;
+    }
+  }
+  for (uint32_t c{0}; c < 4; c++) {
+    rgba[c] = static_cast<uint8_t>(color[c] + 0.5f);
+  }
+}
+
+// Converts a BGRA image into planar I420 with the coefficients of the YUV
+// conversion shader, where each chroma sample averages a 2x2 block.
+static void convertBgraToI420(uint8_t const *bgra, int32_t width,
+    int32_t height, uint8_t *dst, WorkerPool &workerPool)
+{
+  int32_t const chromaWidth = (width + 1) / 2;
+  int32_t const chromaHeight = (height + 1) / 2;
+  uint8_t *yPlane = dst;
+  uint8_t *uPlane = yPlane + width * height;
+  uint8_t *vPlane = uPlane + chromaWidth * chromaHeight;
+  uint32_t const threadCount = workerPool.size();
+  auto toByte{[](float a) {
+    return static_cast<uint8_t>(std::min(255.0f, std::max(0.0f, a)) + 0.5f);
+  }};
+  workerPool.run([bgra, width, height, yPlane, uPlane, vPlane, chromaWidth,
+      chromaHeight, threadCount, &toByte](uint32_t a_thread) {
+      int32_t const row0 = chromaHeight * static_cast<int32_t>(a_thread)
+        / static_cast<int32_t>(threadCount);
+      int32_t const row1 = chromaHeight * static_cast<int32_t>(a_thread + 1) 
+        / static_cast<int32_t>(threadCount);
+      for (int32_t row{row0}; row < row1; row++) {
+        for (int32_t y{2 * row}; y < std::min(2 * row + 2, height); y++) {
+          uint8_t const *line = &bgra[4 * y * width];
+          for (int32_t x{0}; x < width; x++) {
+            yPlane[y * width + x] = toByte(0.257f * line[4 * x + 2] 
+                + 0.504f * line[4 * x + 1] + 0.098f * line[4 * x] 
+                + 15.9375f);
+          }
+        }
+        // The shader samples between the four texels, clamped to the edge,
+        // so the last column and row of odd sized images are used alone.
+        int32_t const y0 = 2 * row;
+        int32_t const y1 = std::min(2 * row + 1, height - 1);
+        for (int32_t column{0}; column < chromaWidth; column++) {
+          int32_t const x0 = 2 * column;
+          int32_t const x1 = std::min(2 * column + 1, width - 1);
+          float rgb[3] = {0.0f, 0.0f, 0.0f};
+          for (int32_t i{0}; i < 3; i++) {
+            rgb[i] = 0.25f * (bgra[4 * (y0 * width + x0) + 2 - i] 
+                + bgra[4 * (y0 * width + x1) + 2 - i] 
+                + bgra[4 * (y1 * width + x0) + 2 - i] 
+                + bgra[4 * (y1 * width + x1) + 2 - i]);
+          }
+          uPlane[row * chromaWidth + column] = toByte(-0.148f * rgb[0] 
+              - 0.291f * rgb[1] + 0.439f * rgb[2] + 127.5f);
+          vPlane[row * chromaWidth + column] = toByte(0.439f * rgb[0] 
+              - 0.368f * rgb[1] - 0.071f * rgb[2] + 127.5f);
+        }
+      }
+    });
+}
+
+// Renders the scene on the CPU, with the same transform, depth test and blend
+// state as the GL pipeline. Fragments take the vertex colour, or the texture
+// repeated across the surface and sampled with its GL filter at the level of
+// detail of the pixel, where anisotropic filtering falls back to trilinear.
+// The frame is rendered in two phases on the worker pool. First, every thread
+// transforms, clips and sets up an equal share of the triangles, in draw
+// order, and sorts them into bins by the screen tiles they overlap. Then,
+// threads take tiles from a shared counter and rasterise the bins of all
+// threads into them in thread order, which keeps the draw order within each
+// tile. Coverage and depth are tested four pixels at a time with SSE2 where
+// available. Edges shared by two triangles are evaluated from the same
+// endpoint by both, so that pixels on them are drawn exactly once.
+class SoftwareRenderer {
+ public:
+  SoftwareRenderer(uint32_t a_width, uint32_t a_height, 
+      WorkerPool &a_workerPool):
+    width(static_cast<int32_t>(a_width)),
+    height(static_cast<int32_t>(a_height)),
+    tileColumns((width + tileSize - 1) / tileSize),
+    tileRows((height + tileSize - 1) / tileSize),
+    workerPool(a_workerPool),
+    colorBuffer(4 * a_width * a_height),
+    depthBuffer(a_width * a_height),
+    workItems(),
+    threadBins(a_workerPool.size()),
+    nextTile(0)
+  {
+    for (auto &bins : threadBins) {
+      bins.tiles.resize(tileColumns * tileRows);
+    }
+  }
+
+  SoftwareRenderer(SoftwareRenderer const &) = delete;
+  SoftwareRenderer &operator=(SoftwareRenderer const &) = delete;
+
+  // The rendered image, stored as BGRA like the GL readback.
+  uint8_t const *colorData() const
+  {
+    return colorBuffer.data();
+  }
+
+  void render(std::vector<uint64_t> const &drawList,
+      std::vector<MeshHandle> const &handles,
+      std::vector<MeshGeometry> const &meshGeometry,
+      std::map<GLuint, SoftwareTexture> const &textures,
+      std::vector<glm::vec4> const &instanceData, glm::mat4 const &vp,
+      glm::mat4 const &overlayVp, DrawStats &drawStats)
+  {
+    workItems.clear();
+    uint64_t triangleCount{0};
+    for (uint64_t const drawKey : drawList) {
+      uint32_t const meshId = static_cast<uint32_t>(
+          drawKey & drawKeyMeshIdMask);
+      MeshHandle const &mh = handles[meshId];
+      auto const texture = textures.find(mh.textureId);
+      uint64_t const meshTriangles = meshGeometry[meshId].indices.size() / 3;
+      for (uint32_t i{0}; i < mh.instanceCount; i++) {
+        workItems.emplace_back(meshId, mh.instanceOffset + i,
+            static_cast<uint32_t>(drawKey >> drawKeyPassShift),
+            (texture != textures.end()) ? &texture->second : nullptr,
+            triangleCount);
+        triangleCount += meshTriangles;
+      }
+      drawStats.drawCalls++;
+      drawStats.drawnTriangles += meshTriangles * mh.instanceCount;
+    }
+
+    uint32_t const threadCount = workerPool.size();
+    workerPool.run([this, &meshGeometry, &instanceData, &vp, &overlayVp,
+        triangleCount, threadCount](uint32_t a_thread) {
+        ThreadBins &bins = threadBins[a_thread];
+        bins.triangles.clear();
+        for (auto &tile : bins.tiles) {
+          tile.clear();
+        }
+        uint64_t const begin = triangleCount * a_thread / threadCount;
+        uint64_t const end = triangleCount * (a_thread + 1) / threadCount;
+        auto item = std::upper_bound(workItems.begin(), workItems.end(), 
+            begin, [](uint64_t a, WorkItem const &b) {
+              return a < b.firstTriangle;
+            });
+        if (item != workItems.begin()) {
+          item--;
+        }
+        for (; item != workItems.end() && item->firstTriangle < end; item++) {
+          setUpInstance(*item, meshGeometry[item->meshId], 
+              instanceData[item->instance], 
+              (item->pass == drawPassOverlay) ? overlayVp : vp, begin, end,
+              bins);
+        }
+      });
+
+    nextTile = 0;
+    workerPool.run([this](uint32_t) {
+        uint32_t const tileCount = tileColumns * tileRows;
+        for (uint32_t tile{nextTile++}; tile < tileCount; tile = nextTile++) {
+          rasteriseTile(tile);
+        }
+      });
+  }
+
+ private:
+  static int32_t const tileSize{64};
+
+  // The instances to draw, in draw order, each covering the triangles of its
+  // mesh from firstTriangle on in a running count over all instances.
+  struct WorkItem {
+    uint32_t meshId;
+    uint32_t instance;
+    uint32_t pass;
+    SoftwareTexture const *texture;
+    uint64_t firstTriangle;
+
+    WorkItem(uint32_t a_meshId, uint32_t a_instance, uint32_t a_pass,
+        SoftwareTexture const *a_texture, uint64_t a_firstTriangle):
+      meshId(a_meshId),
+      instance(a_instance),
+      pass(a_pass),
+      texture(a_texture),
+      firstTriangle(a_firstTriangle) {}
+  };
+
+  struct ClipVertex {
+    glm::vec4 position;
+    glm::vec3 color;
+    glm::vec2 uv;
+
+    ClipVertex():
+      position(),
+      color(),
+      uv() {}
+  };
+
+  // A triangle set up for rasterisation. Each edge function is zero on the
+  // edge and positive inside, evaluated relative to the lower of the edge
+  // endpoints. Attributes divided by w are interpolated as planes, stored as
+  // their value at (x0, y0) and their slopes along x and y.
+  struct Triangle {
+    float edgeA[3];
+    float edgeB[3];
+    float edgeX[3];
+    float edgeY[3];
+    uint32_t topLeft;
+    float x0;
+    float y0;
+    glm::vec3 z;
+    glm::vec3 invW;
+    glm::vec3 u;
+    glm::vec3 v;
+    glm::vec3 color[3];
+    int32_t minX;
+    int32_t minY;
+    int32_t maxX;
+    int32_t maxY;
+    SoftwareTexture const *texture;
+    uint32_t layer;
+    uint32_t pass;
+
+    Triangle():
+      edgeA(),
+      edgeB(),
+      edgeX(),
+      edgeY(),
+      topLeft(),
+      x0(),
+      y0(),
+      z(),
+      invW(),
+      u(),
+      v(),
+      color(),
+      minX(),
+      minY(),
+      maxX(),
+      maxY(),
+      texture(),
+      layer(),
+      pass() {}
+  };
+
+  struct ThreadBins {
+    std::vector<Triangle> triangles;
+    std::vector<std::vector<uint32_t>> tiles;
+
+    ThreadBins():
+      triangles(),
+      tiles() {}
+  };
+
+  void setUpInstance(WorkItem const &item, MeshGeometry const &geometry,
+      glm::vec4 const &instance, glm::mat4 const &vp, uint64_t begin,
+      uint64_t end, ThreadBins &bins)
+  {
+    uint64_t const triangleCount = geometry.indices.size() / 3;
+    uint64_t const first = std::max(begin, item.firstTriangle) 
+      - item.firstTriangle;
+    uint64_t const last = std::min(end, item.firstTriangle + triangleCount) 
+      - item.firstTriangle;
+    float const a = glm::pi<float>() - instance.w;
+    float const c = std::cos(a);
+    float const s = std::sin(a);
+    for (uint64_t triangle{first}; triangle < last; triangle++) {
+      ClipVertex vertices[3];
+      uint32_t outside[6] = {0, 0, 0, 0, 0, 0};
+      bool isTextured{false};
+      for (uint32_t k{0}; k < 3; k++) {
+        Vertex const &vertex = geometry.vertices[
+          geometry.indices[3 * triangle + k]];
+        glm::vec4 const world(c * vertex.pos.x - s * vertex.pos.y + instance.x,
+            s * vertex.pos.x + c * vertex.pos.y + instance.y,
+            vertex.pos.z + instance.z, 1.0f);
+        ClipVertex &clipVertex = vertices[k];
+        clipVertex.position = vp * world;
+        clipVertex.color = vertex.color;
+        clipVertex.uv = vertex.texCoord;
+        glm::vec4 const &p = clipVertex.position;
+        outside[0] += (p.x < -p.w);
+        outside[1] += (p.x > p.w);
+        outside[2] += (p.y < -p.w);
+        outside[3] += (p.y > p.w);
+        outside[4] += (p.z < -p.w);
+        outside[5] += (p.z > p.w);
+        isTextured = isTextured || std::abs(vertex.texCoord.x) > 0.0f 
+          || std::abs(vertex.texCoord.y) > 0.0f;
+      }
+      if (std::find(outside, outside + 6, 3u) != outside + 6) {
+        continue;
+      }
+
+      Triangle setUp;
+      setUp.pass = item.pass;
+      if (isTextured && item.texture != nullptr) {
+        uint32_t const layer = static_cast<uint32_t>(geometry.vertices[
+            geometry.indices[3 * triangle]].layer);
+        if (layer < item.texture->layers.size()) {
+          setUp.texture = item.texture;
+          setUp.layer = layer;
+        }
+      }
+
+      if (outside[4] == 0) {
+        setUpTriangle(vertices[0], vertices[1], vertices[2], setUp, bins);
+        continue;
+      }
+      // Clips against the near plane, leaving a triangle or a quad.
+      ClipVertex clipped[4];
+      uint32_t clippedCount{0};
+      for (uint32_t k{0}; k < 3; k++) {
+        ClipVertex const &current = vertices[k];
+        ClipVertex const &next = vertices[(k + 1) % 3];
+        float const dCurrent = current.position.z + current.position.w;
+        float const dNext = next.position.z + next.position.w;
+        if (dCurrent >= 0.0f) {
+          clipped[clippedCount++] = current;
+        }
+        if ((dCurrent >= 0.0f) != (dNext >= 0.0f)) {
+          float const t = dCurrent / (dCurrent - dNext);
+          ClipVertex &between = clipped[clippedCount++];
+          between.position = current.position 
+            + (next.position - current.position) * t;
+          between.color = current.color + (next.color - current.color) * t;
+          between.uv = current.uv + (next.uv - current.uv) * t;
+        }
+      }
+      for (uint32_t k{2}; k < clippedCount; k++) {
+        setUpTriangle(clipped[0], clipped[k - 1], clipped[k], setUp, bins);
+      }
+    }
+  }
+
+  void setUpTriangle(ClipVertex const &v0, ClipVertex const &v1,
+      ClipVertex const &v2, Triangle setUp, ThreadBins &bins)
+  {
+    ClipVertex const *vertices[3] = {&v0, &v1, &v2};
+    float sx[3];
+    float sy[3];
+    float sz[3];
+    float invW[3];
+    for (uint32_t k{0}; k < 3; k++) {
+      glm::vec4 const &p = vertices[k]->position;
+      invW[k] = 1.0f / p.w;
+      sx[k] = (p.x * invW[k] * 0.5f + 0.5f) * static_cast<float>(width);
+      sy[k] = (p.y * invW[k] * 0.5f + 0.5f) * static_cast<float>(height);
+      sz[k] = p.z * invW[k] * 0.5f + 0.5f;
+    }
+    float const dx1 = sx[1] - sx[0];
+    float const dy1 = sy[1] - sy[0];
+    float const dx2 = sx[2] - sx[0];
+    float const dy2 = sy[2] - sy[0];
+    float const area = dx1 * dy2 - dx2 * dy1;
+    if (!(std::abs(area) > 0.0f)) {
+      return;
+    }
+
+    float const maxX = static_cast<float>(width - 1);
+    float const maxY = static_cast<float>(height - 1);
+    setUp.minX = static_cast<int32_t>(std::floor(std::min(maxX + 1.0f, 
+            std::max(0.0f, std::min(sx[0], std::min(sx[1], sx[2]))))));
+    setUp.minY = static_cast<int32_t>(std::floor(std::min(maxY + 1.0f,
+            std::max(0.0f, std::min(sy[0], std::min(sy[1], sy[2]))))));
+    setUp.maxX = static_cast<int32_t>(std::ceil(std::max(-1.0f,
+            std::min(maxX, std::max(sx[0], std::max(sx[1], sx[2]))))));
+    setUp.maxY = static_cast<int32_t>(std::ceil(std::max(-1.0f,
+            std::min(maxY, std::max(sy[0], std::max(sy[1], sy[2]))))));
+    if (setUp.minX > setUp.maxX || setUp.minY > setUp.maxY) {
+      return;
+    }
+
+    // Edge k lies opposite vertex k. A pixel centre exactly on an edge is
+    // drawn by the triangle that has the edge on its top or left side.
+    float const orientation = (area > 0.0f) ? 1.0f : -1.0f;
+    setUp.topLeft = 0;
+    for (uint32_t k{0}; k < 3; k++) {
+      uint32_t const i = (k + 1) % 3;
+      uint32_t const j = (k + 2) % 3;
+      float const a = (sy[i] - sy[j]) * orientation;
+      float const b = (sx[j] - sx[i]) * orientation;
+      bool const isFirst = sx[i] < sx[j] 
+        || (!(sx[i] > sx[j]) && sy[i] < sy[j]);
+      setUp.edgeA[k] = a;
+      setUp.edgeB[k] = b;
+      setUp.edgeX[k] = isFirst ? sx[i] : sx[j];
+      setUp.edgeY[k] = isFirst ? sy[i] : sy[j];
+      if (a > 0.0f || (!(a < 0.0f) && b > 0.0f)) {
+        setUp.topLeft |= 1u << k;
+      }
+    }
+
+    setUp.x0 = sx[0];
+    setUp.y0 = sy[0];
+    auto plane{[dx1, dy1, dx2, dy2, area](float f0, float f1, float f2) {
+      float const df1 = f1 - f0;
+      float const df2 = f2 - f0;
+      return glm::vec3(f0, (df1 * dy2 - df2 * dy1) / area,
+          (df2 * dx1 - df1 * dx2) / area);
+    }};
+    setUp.z = plane(sz[0], sz[1], sz[2]);
+    setUp.invW = plane(invW[0], invW[1], invW[2]);
+    setUp.u = plane(v0.uv.x * invW[0], v1.uv.x * invW[1], v2.uv.x * invW[2]);
+    setUp.v = plane(v0.uv.y * invW[0], v1.uv.y * invW[1], v2.uv.y * invW[2]);
+    for (uint32_t i{0}; i < 3; i++) {
+      setUp.color[i] = plane(v0.color[i] * invW[0], v1.color[i] * invW[1],
+          v2.color[i] * invW[2]);
+    }
+
+    uint32_t const index = static_cast<uint32_t>(bins.triangles.size());
+    bins.triangles.push_back(setUp);
+    for (int32_t row{setUp.minY / tileSize}; row <= setUp.maxY / tileSize;
+        row++) {
+      for (int32_t column{setUp.minX / tileSize}; 
+          column <= setUp.maxX / tileSize; column++) {
+        bins.tiles[row * tileColumns + column].push_back(index);
+      }
+    }
+  }
+
+  void rasteriseTile(uint32_t a_tile)
+  {
+    int32_t const tileX = static_cast<int32_t>(a_tile % tileColumns) 
+      * tileSize;
+    int32_t const tileY = static_cast<int32_t>(a_tile / tileColumns) 
+      * tileSize;
+    int32_t const tileWidth = std::min(tileSize, width - tileX);
+    int32_t const tileHeight = std::min(tileSize, height - tileY);
+    for (int32_t y{tileY}; y < tileY + tileHeight; y++) {
+      std::fill(&depthBuffer[y * width + tileX], 
+          &depthBuffer[y * width + tileX + tileWidth], 1.0f);
+      for (int32_t x{tileX}; x < tileX + tileWidth; x++) {
+        uint8_t *pixel = &colorBuffer[4 * (y * width + x)];
+        pixel[0] = 51;
+        pixel[1] = 51;
+        pixel[2] = 51;
+        pixel[3] = 0;
+      }
+    }
+
+    for (auto const &bins : threadBins) {
+      for (uint32_t index : bins.tiles[a_tile]) {
+        rasteriseTriangle(bins.triangles[index], tileX, tileY,
+            tileX + tileWidth - 1, tileY + tileHeight - 1);
+      }
+    }
+  }
+
+  void rasteriseTriangle(Triangle const &t, int32_t tileX0, int32_t tileY0, 
+      int32_t tileX1, int32_t tileY1)
+  {
+    int32_t const x0 = std::max(t.minX, tileX0);
+    int32_t const x1 = std::min(t.maxX, tileX1);
+    int32_t const y0 = std::max(t.minY, tileY0);
+    int32_t const y1 = std::min(t.maxY, tileY1);
+    float const xEnd = static_cast<float>(x1) + 0.5f;
+    for (int32_t y{y0}; y <= y1; y++) {
+      float const py = static_cast<float>(y) + 0.5f;
+      float rowC[3];
+      for (uint32_t k{0}; k < 3; k++) {
+        rowC[k] = t.edgeB[k] * (py - t.edgeY[k]) - t.edgeA[k] * t.edgeX[k];
+      }
+      float const zRow = t.z.x + t.z.z * (py - t.y0);
+      for (int32_t x{x0}; x <= x1; x += 4) {
+        float const px = static_cast<float>(x) + 0.5f;
+        float z[4];
+        uint32_t mask{0};
+#if defined(__SSE2__)
+        __m128 const pxs = _mm_add_ps(_mm_set1_ps(px), 
+            _mm_setr_ps(0.0f, 1.0f, 2.0f, 3.0f));
+        __m128 covered = _mm_cmple_ps(pxs, _mm_set1_ps(xEnd));
+        for (uint32_t k{0}; k < 3; k++) {
+          __m128 const e = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(t.edgeA[k]), 
+                pxs), _mm_set1_ps(rowC[k]));
+          covered = _mm_and_ps(covered, ((t.topLeft >> k) & 1) 
+              ? _mm_cmpge_ps(e, _mm_setzero_ps()) 
+              : _mm_cmpgt_ps(e, _mm_setzero_ps()));
+        }
+        __m128 const zs = _mm_add_ps(_mm_set1_ps(zRow), _mm_mul_ps(
+              _mm_set1_ps(t.z.y), _mm_sub_ps(pxs, _mm_set1_ps(t.x0))));
+        // The depth of pixels past the tile belongs to the thread that
+        // rasterises the neighbouring tile, so it must not be read here.
+        __m128 depths;
+        if (x + 3 <= tileX1) {
+          depths = _mm_loadu_ps(&depthBuffer[y * width + x]);
+        } else {
+          float d[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+          for (int32_t i{0}; x + i <= tileX1; i++) {
+            d[i] = depthBuffer[y * width + x + i];
+          }
+          depths = _mm_loadu_ps(d);
+        }
+        covered = _mm_and_ps(covered, _mm_cmplt_ps(zs, depths));
+        mask = static_cast<uint32_t>(_mm_movemask_ps(covered));
+        _mm_storeu_ps(z, zs);
+#else
+        for (uint32_t i{0}; i < 4; i++) {
+          float const pxi = px + static_cast<float>(i);
+          bool covered{pxi <= xEnd};
+          for (uint32_t k{0}; k < 3; k++) {
+            float const e = t.edgeA[k] * pxi + rowC[k];
+            covered = covered && (((t.topLeft >> k) & 1) ? e >= 0.0f 
+                : e > 0.0f);
+          }
+          z[i] = zRow + t.z.y * (pxi - t.x0);
+          covered = covered && z[i] < depthBuffer[y * width + x 
+            + static_cast<int32_t>(i)];
+          mask |= static_cast<uint32_t>(covered) << i;
+        }
+#endif
+        for (uint32_t i{0}; mask != 0; i++, mask >>= 1) {
+          if ((mask & 1) != 0) {
+            shadePixel(t, x + static_cast<int32_t>(i), y, z[i]);
+          }
+        }
+      }
+    }
+  }
+
+  void shadePixel(Triangle const &t, int32_t x, int32_t y, float z)
+  {
+    float const dx = static_cast<float>(x) + 0.5f - t.x0;
+    float const dy = static_cast<float>(y) + 0.5f - t.y0;
+    float const w = 1.0f / (t.invW.x + t.invW.y * dx + t.invW.z * dy);
+    uint8_t rgba[4];
+    if (t.texture != nullptr) {
+      float const u = (t.u.x + t.u.y * dx + t.u.z * dy) * w;
+      float const v = (t.v.x + t.v.y * dx + t.v.z * dy) * w;
+      // The screen space derivatives of u and v give the level of detail.
+      float const tw = static_cast<float>(t.texture->width);
+      float const th = static_cast<float>(t.texture->height);
+      float const dudx = (t.u.y - u * t.invW.y) * w * tw;
+      float const dvdx = (t.v.y - v * t.invW.y) * w * th;
+      float const dudy = (t.u.z - u * t.invW.z) * w * tw;
+      float const dvdy = (t.v.z - v * t.invW.z) * w * th;
+      float const lod = 0.5f * std::log2(std::max(1.0e-12f, 
+            std::max(dudx * dudx + dvdx * dvdx, dudy * dudy + dvdy * dvdy)));
+      sampleTexture(*t.texture, t.layer, u, v, lod, rgba);
+    } else {
+      for (uint32_t i{0}; i < 3; i++) {
+        float const c = (t.color[i].x + t.color[i].y * dx 
+            + t.color[i].z * dy) * w;
+        rgba[i] = static_cast<uint8_t>(
+            std::min(1.0f, std::max(0.0f, c)) * 255.0f + 0.5f);
+      }
+      rgba[3] = 255;
+    }
+
+    uint8_t *pixel = &colorBuffer[4 * (y * width + x)];
+    if (t.pass == drawPassOpaque) {
+      depthBuffer[y * width + x] = z;
+      pixel[0] = rgba[2];
+      pixel[1] = rgba[1];
+      pixel[2] = rgba[0];
+      pixel[3] = rgba[3];
+    } else {
+      // Blends like glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA).
+      uint32_t const keep = 255u - rgba[3];
+      uint8_t const bgra[4] = {rgba[2], rgba[1], rgba[0], rgba[3]};
+      for (uint32_t i{0}; i < 4; i++) {
+        pixel[i] = static_cast<uint8_t>(std::min(255u, 
+              bgra[i] + (pixel[i] * keep + 127u) / 255u));
+      }
+    }
+  }
+
+  int32_t const width;
+  int32_t const height;
+  int32_t const tileColumns;
+  int32_t const tileRows;
+  WorkerPool &workerPool;
+  std::vector<uint8_t> colorBuffer;
+  std::vector<float> depthBuffer;
+  std::vector<WorkItem> workItems;
+  std::vector<ThreadBins> threadBins;
+  std::atomic<uint32_t> nextTile;
+};
+
+// A bounding volume hierarchy over items with bounding boxes. Leaves hold
+// count items from first on in the item order, while inner nodes have a
+// count of zero and their two children at first and first + 1.
+struct BvhNode {
+  glm::vec3 boundsMin;
+  glm::vec3 boundsMax;
+  uint32_t first;
+  uint32_t count;
+
+  BvhNode():
+    boundsMin(),
+    boundsMax(),
+    first(),
+    count() {}
+};
+
+struct Bvh {
+  std::vector<BvhNode> nodes;
+  std::vector<uint32_t> items;
+
+  Bvh():
+    nodes(),
+    items() {}
+};
+
+// Ray cast meshes are intersected as the box of their bounds, as a surface of
+// revolution around their z axis, or triangle by triangle.
+uint32_t const rayShapeMesh{0};
+uint32_t const rayShapeBox{1};
+uint32_t const rayShapeLathe{2};
+
+// A mesh as seen by the ray caster, in mesh space. Boxes are textured like
+// the generated blocks, with texture coordinates growing by textureScale per
+// metre along the face. Surfaces of revolution are the union of the frusta
+// (z0, r0, z1, r1) and the flat rings (z, inner radius, outer radius) that
+// their faces lie on. Other meshes keep a hierarchy over their triangles.
+struct RayShape {
+  uint32_t kind;
+  glm::vec3 boundsMin;
+  glm::vec3 boundsMax;
+  glm::vec3 color;
+  glm::vec2 textureScale;
+  SoftwareTexture const *texture;
+  uint32_t layer;
+  std::vector<glm::vec4> frusta;
+  std::vector<glm::vec3> rings;
+  Bvh bvh;
+
+  RayShape():
+    kind(rayShapeMesh),
+    boundsMin(),
+    boundsMax(),
+    color(),
+    textureScale(),
+    texture(),
+    layer(),
+    frusta(),
+    rings(),
+    bvh() {}
+  RayShape(RayShape const &) = default;
+  RayShape &operator=(RayShape const &) = default;
+};
+
+// An instance rotated by the angle with cosine c and sine s around z, the
+// same transform as in the vertex shader. Object ids are 1 + the row of the
+// instance in the map for static instances, and 0x80000000 + the frame id
+// for instances following a frame.
+struct RayInstance {
+  glm::vec3 position;
+  float c;
+  float s;
+  uint32_t meshId;
+  uint32_t objectId;
+
+  RayInstance(glm::vec3 a_position, float a_rotation, uint32_t a_meshId,
+      uint32_t a_objectId):
+    position(a_position),
+    c(std::cos(glm::pi<float>() - a_rotation)),
+    s(std::sin(glm::pi<float>() - a_rotation)),
+    meshId(a_meshId),
+    objectId(a_objectId) {}
+};
+
+struct RayScene {
+  std::vector<RayShape> shapes;
+  std::vector<RayInstance> instances;
+  std::vector<RayInstance> overlays;
+  Bvh bvh;
+
+  RayScene():
+    shapes(),
+    instances(),
+    overlays(),
+    bvh() {}
+};
+
+// Splits the items at the median of their centres along the longest axis,
+// until at most four are left in a node.
+static Bvh buildBvh(std::vector<glm::vec3> const &itemMin,
+    std::vector<glm::vec3> const &itemMax)
+{
+  Bvh bvh;
+  uint32_t const itemCount = static_cast<uint32_t>(itemMin.size());
+  if (itemCount == 0) {
+    return bvh;
+  }
+  bvh.items.resize(itemCount);
+  for (uint32_t i{0}; i < itemCount; i++) {
+    bvh.items[i] = i;
+  }
+  bvh.nodes.emplace_back();
+  std::vector<std::tuple<uint32_t, uint32_t, uint32_t>> pending{
+    std::make_tuple(0u, 0u, itemCount)};
+  while (!pending.empty()) {
+    uint32_t const node = std::get<0>(pending.back());
+    uint32_t const begin = std::get<1>(pending.back());
+    uint32_t const end = std::get<2>(pending.back());
+    pending.pop_back();
+
+    glm::vec3 boundsMin = itemMin[bvh.items[begin]];
+    glm::vec3 boundsMax = itemMax[bvh.items[begin]];
+    glm::vec3 centerMin = 0.5f * (boundsMin + boundsMax);
+    glm::vec3 centerMax = centerMin;
+    for (uint32_t i{begin}; i < end; i++) {
+      uint32_t const item = bvh.items[i];
+      boundsMin = glm::min(boundsMin, itemMin[item]);
+      boundsMax = glm::max(boundsMax, itemMax[item]);
+      glm::vec3 const center = 0.5f * (itemMin[item] + itemMax[item]);
+      centerMin = glm::min(centerMin, center);
+      centerMax = glm::max(centerMax, center);
+    }
+    bvh.nodes[node].boundsMin = boundsMin;
+    bvh.nodes[node].boundsMax = boundsMax;
+    if (end - begin <= 4) {
+      bvh.nodes[node].first = begin;
+      bvh.nodes[node].count = end - begin;
+      continue;
+    }
+
+    glm::vec3 const extent = centerMax - centerMin;
+    int32_t const axis = (extent.x > extent.y && extent.x > extent.z) ? 0 
+      : ((extent.y > extent.z) ? 1 : 2);
+    uint32_t const middle = (begin + end) / 2;
+    std::nth_element(bvh.items.begin() + begin, bvh.items.begin() + middle,
+        bvh.items.begin() + end, [&itemMin, &itemMax, axis](uint32_t a,
+          uint32_t b) {
+          return itemMin[a][axis] + itemMax[a][axis] 
+            < itemMin[b][axis] + itemMax[b][axis];
+        });
+    uint32_t const child = static_cast<uint32_t>(bvh.nodes.size());
+    bvh.nodes.emplace_back();
+    bvh.nodes.emplace_back();
+    bvh.nodes[node].first = child;
+    bvh.nodes[node].count = 0;
+    pending.emplace_back(child, begin, middle);
+    pending.emplace_back(child + 1, middle, end);
+  }
+  return bvh;
+}
+
+// Tests a mesh for being a surface of revolution around its z axis, as the
+// cones of the maps are, and if so describes its faces as frusta and flat
+// rings. Every vertex height off the axis must hold a ring of at least 16
+// vertices, and every slanted triangle must join two rings of equal radius
+// along its edges, within one percent of the mesh size.
+static bool fitLathe(MeshGeometry const &geometry, RayShape &shape)
+{
+  if (geometry.vertices.empty()) {
+    return false;
+  }
+  float maxRadius{0.0f};
+  float minZ{geometry.vertices[0].pos.z};
+  float maxZ{minZ};
+  for (auto const &vertex : geometry.vertices) {
+    maxRadius = std::max(maxRadius, std::sqrt(vertex.pos.x * vertex.pos.x 
+          + vertex.pos.y * vertex.pos.y));
+    minZ = std::min(minZ, vertex.pos.z);
+    maxZ = std::max(maxZ, vertex.pos.z);
+  }
+  float const tolerance = 0.01f * std::max(maxRadius, maxZ - minZ) + 1.0e-6f;
+
+  std::map<int64_t, uint32_t> levelSizes;
+  std::vector<int64_t> vertexLevels;
+  std::vector<float> vertexRadii;
+  for (auto const &vertex : geometry.vertices) {
+    int64_t const level = static_cast<int64_t>(std::floor(
+          (vertex.pos.z - minZ) / tolerance + 0.5f));
+    float const radius = std::sqrt(vertex.pos.x * vertex.pos.x 
+        + vertex.pos.y * vertex.pos.y);
+    vertexLevels.push_back(level);
+    vertexRadii.push_back(radius);
+    // Apexes and centres of caps lie on the axis at any resolution.
+    if (radius > tolerance) {
+      levelSizes[level]++;
+    }
+  }
+  for (auto const &levelSize : levelSizes) {
+    if (levelSize.second < 16) {
+      return false;
+    }
+  }
+
+  std::map<std::tuple<int64_t, int64_t, int64_t, int64_t>, glm::vec4> frusta;
+  std::map<int64_t, glm::vec3> rings;
+  for (size_t i{0}; i + 2 < geometry.indices.size(); i += 3) {
+    uint32_t const *corners = &geometry.indices[i];
+    int64_t lowLevel{vertexLevels[corners[0]]};
+    int64_t highLevel{lowLevel};
+    for (uint32_t k{1}; k < 3; k++) {
+      lowLevel = std::min(lowLevel, vertexLevels[corners[k]]);
+      highLevel = std::max(highLevel, vertexLevels[corners[k]]);
+    }
+    if (lowLevel == highLevel) {
+      // The ring reaches the axis if the triangle covers it.
+      glm::vec3 &ring = rings.emplace(lowLevel, glm::vec3(
+            geometry.vertices[corners[0]].pos.z, 
+            std::numeric_limits<float>::max(), 0.0f)).first->second;
+      float side[3];
+      for (uint32_t k{0}; k < 3; k++) {
+        glm::vec3 const &a = geometry.vertices[corners[k]].pos;
+        glm::vec3 const &b = geometry.vertices[corners[(k + 1) % 3]].pos;
+        side[k] = a.x * b.y - a.y * b.x;
+        glm::vec2 const ab(b.x - a.x, b.y - a.y);
+        float const along = std::min(1.0f, std::max(0.0f, 
+              -(a.x * ab.x + a.y * ab.y) / std::max(glm::dot(ab, ab), 
+                1.0e-12f)));
+        ring.y = std::min(ring.y, glm::length(glm::vec2(a.x + ab.x * along,
+                a.y + ab.y * along)));
+        ring.z = std::max(ring.z, vertexRadii[corners[k]]);
+      }
+      if ((side[0] >= 0.0f && side[1] >= 0.0f && side[2] >= 0.0f)
+          || (side[0] <= 0.0f && side[1] <= 0.0f && side[2] <= 0.0f)) {
+        ring.y = 0.0f;
+      }
+      continue;
+    }
+
+    float lowRadius{-1.0f};
+    float highRadius{-1.0f};
+    for (uint32_t k{0}; k < 3; k++) {
+      int64_t const level = vertexLevels[corners[k]];
+      float const radius = vertexRadii[corners[k]];
+      float &ringRadius = (level == lowLevel) ? lowRadius : highRadius;
+      if (level != lowLevel && level != highLevel) {
+        return false;
+      }
+      if (ringRadius >= 0.0f && std::abs(ringRadius - radius) > tolerance) {
+        return false;
+      }
+      ringRadius = std::max(ringRadius, radius);
+    }
+    float lowZ{0.0f};
+    float highZ{0.0f};
+    for (uint32_t k{0}; k < 3; k++) {
+      float const z = geometry.vertices[corners[k]].pos.z;
+      (vertexLevels[corners[k]] == lowLevel ? lowZ : highZ) = z;
+    }
+    frusta[std::make_tuple(lowLevel, highLevel, 
+        static_cast<int64_t>(lowRadius / tolerance), 
+        static_cast<int64_t>(highRadius / tolerance))] = 
+      glm::vec4(lowZ, lowRadius, highZ, highRadius);
+  }
+  if (frusta.empty()) {
+    return false;
+  }
+
+  shape.kind = rayShapeLathe;
+  for (auto const &frustum : frusta) {
+    shape.frusta.push_back(frustum.second);
+  }
+  for (auto const &ring : rings) {
+    shape.rings.push_back(ring.second);
+  }
+  return true;
+}
+
+// Describes every mesh for the ray caster and builds a hierarchy over the
+// world space bounds of the static instances. Blocks are boxes, untextured
+// models that are surfaces of revolution are intersected analytically and
+// all other meshes by their triangles. Overlays are kept aside, to be drawn
+// over the image.
+RayScene buildRayScene(std::vector<MeshHandle> const &handles,
+    std::vector<MeshGeometry> const &meshGeometry,
+    std::map<GLuint, SoftwareTexture> const &softwareTextures,
+    std::vector<BlockInfo> const &blockInfo,
+    std::map<std::string, uint32_t> const &meshIds,
+    MeshInstances const &meshInstances, bool verbose)
+{
+  RayScene scene;
+  scene.shapes.resize(handles.size());
+  std::vector<bool> isBlock(handles.size(), false);
+  for (auto const &info : blockInfo) {
+    uint32_t const meshId = meshIds.at(info.name);
+    RayShape &shape = scene.shapes[meshId];
+    shape.kind = rayShapeBox;
+    if (info.isOrthogonal) {
+      shape.textureScale = glm::vec2(-1.0f / info.dimension.x, 
+          -1.0f / info.dimension.y);
+    } else if (!info.textureFilename.empty()) {
+      shape.textureScale = glm::vec2(1.0f / info.textureSize.x,
+          1.0f / info.textureSize.y);
+    }
+    isBlock[meshId] = true;
+  }
+
+  uint32_t shapeCounts[3] = {0, 0, 0};
+  for (uint32_t meshId{0}; meshId < handles.size(); meshId++) {
+    MeshHandle const &handle = handles[meshId];
+    MeshGeometry const &geometry = meshGeometry[meshId];
+    RayShape &shape = scene.shapes[meshId];
+    if (handle.lodCellSize > 0.0f || geometry.vertices.empty()) {
+      continue;
+    }
+    shape.boundsMin = handle.boundsMin;
+    shape.boundsMax = handle.boundsMax;
+    shape.color = geometry.vertices[0].color;
+    shape.layer = static_cast<uint32_t>(geometry.vertices[0].layer);
+    auto const texture = softwareTextures.find(handle.textureId);
+    if (texture != softwareTextures.end() 
+        && shape.layer < texture->second.layers.size()) {
+      shape.texture = &texture->second;
+    }
+    bool isTextured{false};
+    for (auto const &vertex : geometry.vertices) {
+      isTextured = isTextured || std::abs(vertex.texCoord.x) > 0.0f 
+        || std::abs(vertex.texCoord.y) > 0.0f;
+    }
+    if (!isBlock[meshId] && (isTextured || !fitLathe(geometry, shape))) {
+      std::vector<glm::vec3> triangleMin;
+      std::vector<glm::vec3> triangleMax;
+      for (size_t i{0}; i + 2 < geometry.indices.size(); i += 3) {
+        glm::vec3 const &a = geometry.vertices[geometry.indices[i]].pos;
+        glm::vec3 const &b = geometry.vertices[geometry.indices[i + 1]].pos;
+        glm::vec3 const &c = geometry.vertices[geometry.indices[i + 2]].pos;
+        triangleMin.push_back(glm::min(a, glm::min(b, c)));
+        triangleMax.push_back(glm::max(a, glm::max(b, c)));
+      }
+      shape.bvh = buildBvh(triangleMin, triangleMax);
+    }
+    shapeCounts[shape.kind]++;
+  }
+
+  std::vector<glm::vec3> instanceMin;
+  std::vector<glm::vec3> instanceMax;
+  for (uint32_t i{0}; i < meshInstances.size(); i++) {
+    uint32_t const meshId = meshInstances.meshId[i];
+    RayInstance const instance(meshInstances.position[i], 
+        meshInstances.rotation[i], meshId, i + 1);
+    if (handles[meshId].isOrthogonal) {
+      scene.overlays.push_back(instance);
+      continue;
+    }
+    if (handles[meshId].indexCount == 0) {
+      continue;
+    }
+    RayShape const &shape = scene.shapes[meshId];
+    glm::vec3 boundsMin(std::numeric_limits<float>::max());
+    glm::vec3 boundsMax(-std::numeric_limits<float>::max());
+    for (uint32_t corner{0}; corner < 4; corner++) {
+      float const x = (corner & 1) ? shape.boundsMax.x : shape.boundsMin.x;
+      float const y = (corner & 2) ? shape.boundsMax.y : shape.boundsMin.y;
+      glm::vec3 const p(instance.c * x - instance.s * y, 
+          instance.s * x + instance.c * y, 0.0f);
+      boundsMin = glm::min(boundsMin, p);
+      boundsMax = glm::max(boundsMax, p);
+    }
+    boundsMin.z = shape.boundsMin.z;
+    boundsMax.z = shape.boundsMax.z;
+    instanceMin.push_back(boundsMin + instance.position);
+    instanceMax.push_back(boundsMax + instance.position);
+    scene.instances.push_back(instance);
+  }
+  scene.bvh = buildBvh(instanceMin, instanceMax);
+
+  if (verbose) {
+    std::clog << "Ray casting " << scene.instances.size() 
+      << " static instances of " << shapeCounts[rayShapeBox] << " boxes, " 
+      << shapeCounts[rayShapeLathe] << " surfaces of revolution and " 
+      << shapeCounts[rayShapeMesh] << " triangle meshes" << std::endl;
+  }
+  return scene;
+}
+
+// Renders the scene by casting one ray per pixel, in bands of rows taken by
+// the threads of the worker pool as they become free. Rays start at the near
+// plane and end at the far plane of the GL projection, and are scaled to one
+// metre of view depth, so that the distance along a ray is the depth of the
+// hit. Besides the image, the view depth in metres and the object id of the
+// nearest hit are kept for every pixel, zero where nothing was hit. Shading
+// follows the GL shader, except that texels that are less than half opaque
+// are skipped instead of blended. Overlays are drawn over the image, placed
+// in pixels of an image of overlaySize.
+class RayCaster {
+ public:
+  RayCaster(uint32_t a_width, uint32_t a_height, WorkerPool &a_workerPool,
+      RayScene const &a_scene, std::vector<MeshGeometry> const &a_meshGeometry,
+      glm::vec2 const &a_overlaySize):
+    width(static_cast<int32_t>(a_width)),
+    height(static_cast<int32_t>(a_height)),
+    overlayScale(a_overlaySize.x / static_cast<float>(a_width),
+        a_overlaySize.y / static_cast<float>(a_height)),
+    workerPool(a_workerPool),
+    scene(a_scene),
+    meshGeometry(a_meshGeometry),
+    colorBuffer(4 * a_width * a_height),
+    depthBuffer(a_width * a_height),
+    objectIdBuffer(a_width * a_height),
+    nextBand(0) {}
+
+  RayCaster(RayCaster const &) = delete;
+  RayCaster &operator=(RayCaster const &) = delete;
+
+  uint8_t const *colorData() const
+  {
+    return colorBuffer.data();
+  }
+
+  float const *depthData() const
+  {
+    return depthBuffer.data();
+  }
+
+  uint32_t const *objectIdData() const
+  {
+    return objectIdBuffer.data();
+  }
+
+  // Fills the buffers as if no ray hit anything.
+  void clear()
+  {
+    for (size_t i{0}; i < depthBuffer.size(); i++) {
+      uint8_t *pixel = &colorBuffer[4 * i];
+      pixel[0] = 51;
+      pixel[1] = 51;
+      pixel[2] = 51;
+      pixel[3] = 0;
+    }
+    std::fill(depthBuffer.begin(), depthBuffer.end(), 0.0f);
+    std::fill(objectIdBuffer.begin(), objectIdBuffer.end(), 0);
+  }
+
+  void render(glm::mat4 const &vp, glm::mat4 const &view,
+      std::vector<RayInstance> const &frameInstances)
+  {
+    glm::mat4 const vpInverse = glm::inverse(vp);
+    glm::mat4 const viewInverse = glm::inverse(view);
+    glm::vec3 const origin(viewInverse[3]);
+    glm::vec3 const forward = -glm::vec3(viewInverse[2]);
+    int32_t const bandCount = (height + bandHeight - 1) / bandHeight;
+    nextBand = 0;
+    workerPool.run([this, &vpInverse, &origin, &forward, &frameInstances,
+        bandCount](uint32_t) {
+        for (int32_t band{nextBand++}; band < bandCount; band = nextBand++) {
+          for (int32_t y{band * bandHeight}; 
+              y < std::min(height, (band + 1) * bandHeight); y++) {
+            for (int32_t x{0}; x < width; x++) {
+              glm::vec4 const p = vpInverse * glm::vec4(
+                  (static_cast<float>(x) + 0.5f) / width * 2.0f - 1.0f,
+                  (static_cast<float>(y) + 0.5f) / height * 2.0f - 1.0f, 
+                  1.0f, 1.0f);
+              glm::vec3 direction = glm::vec3(p) / p.w - origin;
+              direction = direction / glm::dot(direction, forward);
+              castRay(origin, direction, frameInstances, x, y);
+            }
+          }
+        }
+      });
+  }
+
+ private:
+  static int32_t const bandHeight{8};
+
+  struct RayHit {
+    float t;
+    uint32_t objectId;
+    uint8_t rgba[4];
+
+    RayHit():
+      t(),
+      objectId(),
+      rgba() {}
+  };
+
+  static bool intersectsBox(glm::vec3 const &boundsMin, 
+      glm::vec3 const &boundsMax, glm::vec3 const &origin,
+      glm::vec3 const &invDirection, float tMax)
+  {
+    float tNear{nearPlane};
+    float tFar{tMax};
+    for (int32_t axis{0}; axis < 3; axis++) {
+      float t0 = (boundsMin[axis] - origin[axis]) * invDirection[axis];
+      float t1 = (boundsMax[axis] - origin[axis]) * invDirection[axis];
+      tNear = std::max(tNear, std::min(t0, t1));
+      tFar = std::min(tFar, std::max(t0, t1));
+    }
+    return tNear <= tFar;
+  }
+
+  template<typename TestItem>
+  static void traverse(Bvh const &bvh, glm::vec3 const &origin, 
+      glm::vec3 const &invDirection, RayHit const &hit, 
+      TestItem const &testItem)
+  {
+    if (bvh.nodes.empty()) {
+      return;
+    }
+    uint32_t stack[64];
+    uint32_t stackSize{0};
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+      BvhNode const &node = bvh.nodes[stack[--stackSize]];
+      if (!intersectsBox(node.boundsMin, node.boundsMax, origin, invDirection,
+            hit.t)) {
+        continue;
+      }
+      if (node.count > 0) {
+        for (uint32_t i{node.first}; i < node.first + node.count; i++) {
+          testItem(bvh.items[i]);
+        }
+      } else {
+        stack[stackSize++] = node.first;
+        stack[stackSize++] = node.first + 1;
+      }
+    }
+  }
+
+  void castRay(glm::vec3 const &origin, glm::vec3 const &direction,
+      std::vector<RayInstance> const &frameInstances, int32_t x, int32_t y)
+  {
+    RayHit hit;
+    hit.t = farPlane;
+    glm::vec3 const invDirection = 1.0f / direction;
+    traverse(scene.bvh, origin, invDirection, hit, 
+        [this, &origin, &direction, &hit](uint32_t a_item) {
+          intersectInstance(scene.instances[a_item], origin, direction, hit);
+        });
+    for (auto const &instance : frameInstances) {
+      intersectInstance(instance, origin, direction, hit);
+    }
+
+    uint32_t const index = static_cast<uint32_t>(y * width + x);
+    uint8_t *pixel = &colorBuffer[4 * index];
+    if (hit.objectId != 0) {
+      pixel[0] = hit.rgba[2];
+      pixel[1] = hit.rgba[1];
+      pixel[2] = hit.rgba[0];
+      pixel[3] = hit.rgba[3];
+      depthBuffer[index] = hit.t;
+    } else {
+      pixel[0] = 51;
+      pixel[1] = 51;
+      pixel[2] = 51;
+      pixel[3] = 0;
+      depthBuffer[index] = 0.0f;
+    }
+    objectIdBuffer[index] = hit.objectId;
+
+    // Overlays are placed in pixels from the top left corner, see projO.
+    float const overlayX = (static_cast<float>(x) + 0.5f) * overlayScale.x;
+    float const overlayY = (static_cast<float>(height - y) - 0.5f) 
+      * overlayScale.y;
+    for (auto const &overlay : scene.overlays) {
+      RayShape const &shape = scene.shapes[overlay.meshId];
+      float const dx = overlayX - overlay.position.x;
+      float const dy = overlayY - overlay.position.y;
+      float const lx = overlay.c * dx + overlay.s * dy;
+      float const ly = -overlay.s * dx + overlay.c * dy;
+      if (shape.texture == nullptr || lx < shape.boundsMin.x 
+          || lx > shape.boundsMax.x || ly < shape.boundsMin.y 
+          || ly > shape.boundsMax.y) {
+        continue;
+      }
+      uint8_t const *rgba = sampleNearest(*shape.texture, shape.layer,
+          (lx - shape.boundsMin.x) * shape.textureScale.x,
+          (ly - shape.boundsMin.y) * shape.textureScale.y);
+      uint32_t const keep = 255u - rgba[3];
+      uint8_t const bgra[4] = {rgba[2], rgba[1], rgba[0], rgba[3]};
+      for (uint32_t i{0}; i < 4; i++) {
+        pixel[i] = static_cast<uint8_t>(std::min(255u, 
+              bgra[i] + (pixel[i] * keep + 127u) / 255u));
+      }
+    }
+  }
+
+  // Shades a hit at distance t, and keeps it unless the texel there is
+  // mostly transparent.
+  static bool acceptHit(RayShape const &shape, float t, uint32_t objectId,
+      glm::vec2 const &uv, glm::vec3 const &color, bool isTextured,
+      RayHit &hit)
+  {
+    if (isTextured && shape.texture != nullptr) {
+      uint8_t const *texel = sampleNearest(*shape.texture, shape.layer, uv.x,
+          uv.y);
+      if (texel[3] < 128) {
+        return false;
+      }
+      memcpy(hit.rgba, texel, 4);
+    } else {
+      for (int32_t i{0}; i < 3; i++) {
+        hit.rgba[i] = static_cast<uint8_t>(
+            std::min(1.0f, std::max(0.0f, color[i])) * 255.0f + 0.5f);
+      }
+      hit.rgba[3] = 255;
+    }
+    hit.t = t;
+    hit.objectId = objectId;
+    return true;
+  }
+
+  void intersectInstance(RayInstance const &instance, glm::vec3 const &origin,
+      glm::vec3 const &direction, RayHit &hit) const
+  {
+    RayShape const &shape = scene.shapes[instance.meshId];
+    glm::vec3 const relative = origin - instance.position;
+    glm::vec3 const o(instance.c * relative.x + instance.s * relative.y,
+        -instance.s * relative.x + instance.c * relative.y, relative.z);
+    glm::vec3 const d(instance.c * direction.x + instance.s * direction.y,
+        -instance.s * direction.x + instance.c * direction.y, direction.z);
+    glm::vec3 const invDirection = 1.0f / d;
+    if (!intersectsBox(shape.boundsMin, shape.boundsMax, o, invDirection,
+          hit.t)) {
+      return;
+    }
+
+    if (shape.kind == rayShapeBox) {
+      // The ray may start inside a box, in which case its far side is seen.
+      float tNear{-std::numeric_limits<float>::max()};
+      float tFar{std::numeric_limits<float>::max()};
+      int32_t nearAxis{0};
+      int32_t farAxis{0};
+      for (int32_t axis{0}; axis < 3; axis++) {
+        float const t0 = (shape.boundsMin[axis] - o[axis]) 
+          * invDirection[axis];
+        float const t1 = (shape.boundsMax[axis] - o[axis]) 
+          * invDirection[axis];
+        if (std::min(t0, t1) > tNear) {
+          tNear = std::min(t0, t1);
+          nearAxis = axis;
+        }
+        if (std::max(t0, t1) < tFar) {
+          tFar = std::max(t0, t1);
+          farAxis = axis;
+        }
+      }
+      bool const isInside{tNear < nearPlane};
+      float const t = isInside ? tFar : tNear;
+      int32_t const axis = isInside ? farAxis : nearAxis;
+      if (t < nearPlane || t >= hit.t) {
+        return;
+      }
+      glm::vec3 const p = o + d * t - shape.boundsMin;
+      glm::vec2 const uv = (axis == 2) ? glm::vec2(p.x, p.y) 
+        : ((axis == 1) ? glm::vec2(p.x, p.z) : glm::vec2(p.y, p.z));
+      acceptHit(shape, t, instance.objectId, uv * shape.textureScale,
+          shape.color, std::abs(shape.textureScale.x) > 0.0f, hit);
+    } else if (shape.kind == rayShapeLathe) {
+      // Solved in double precision, as the cones are small compared to the
+      // distances they are seen from.
+      double best{hit.t};
+      double const ox{o.x};
+      double const oy{o.y};
+      double const oz{o.z};
+      double const dx{d.x};
+      double const dy{d.y};
+      double const dz{d.z};
+      for (auto const &frustum : shape.frusta) {
+        double const z0{frustum.x};
+        double const z1{frustum.z};
+        double const k = (frustum.w - frustum.y) / (z1 - z0);
+        double const r = frustum.y + k * (oz - z0);
+        double const a = dx * dx + dy * dy - k * k * dz * dz;
+        double const b = 2.0 * (ox * dx + oy * dy - r * k * dz);
+        double const c = ox * ox + oy * oy - r * r;
+        double const discriminant = b * b - 4.0 * a * c;
+        if (discriminant < 0.0 || std::abs(a) < 1.0e-12) {
+          continue;
+        }
+        double const root = std::sqrt(discriminant);
+        for (double const t : {(-b - root) / (2.0 * a), 
+            (-b + root) / (2.0 * a)}) {
+          double const z = oz + t * dz;
+          if (t >= nearPlane && t < best && z >= z0 && z <= z1 
+              && r + k * t * dz >= 0.0) {
+            best = t;
+          }
+        }
+      }
+      for (auto const &ring : shape.rings) {
+        if (std::abs(dz) < 1.0e-12) {
+          continue;
+        }
+        double const t = (ring.x - oz) / dz;
+        double const x = ox + t * dx;
+        double const y = oy + t * dy;
+        double const rr = x * x + y * y;
+        if (t >= nearPlane && t < best && rr >= ring.y * ring.y 
+            && rr <= ring.z * ring.z) {
+          best = t;
+        }
+      }
+      if (best < hit.t) {
+        acceptHit(shape, static_cast<float>(best), instance.objectId, 
+            glm::vec2(0.0f, 0.0f), shape.color, false, hit);
+      }
+    } else {
+      MeshGeometry const &geometry = meshGeometry[instance.meshId];
+      traverse(shape.bvh, o, invDirection, hit, 
+          [&geometry, &shape, &instance, &o, &d, &hit](uint32_t a_triangle) {
+            Vertex const &v0 = geometry.vertices[
+              geometry.indices[3 * a_triangle]];
+            Vertex const &v1 = geometry.vertices[
+              geometry.indices[3 * a_triangle + 1]];
+            Vertex const &v2 = geometry.vertices[
+              geometry.indices[3 * a_triangle + 2]];
+            glm::vec3 const e1 = v1.pos - v0.pos;
+            glm::vec3 const e2 = v2.pos - v0.pos;
+            glm::vec3 const p = glm::cross(d, e2);
+            float const determinant = glm::dot(e1, p);
+            if (!(std::abs(determinant) > 1.0e-12f)) {
+              return;
+            }
+            float const inverse = 1.0f / determinant;
+            glm::vec3 const s = o - v0.pos;
+            float const u = glm::dot(s, p) * inverse;
+            glm::vec3 const q = glm::cross(s, e1);
+            float const v = glm::dot(d, q) * inverse;
+            float const t = glm::dot(e2, q) * inverse;
+            if (u < 0.0f || v < 0.0f || u + v > 1.0f || t < nearPlane 
+                || t >= hit.t) {
+              return;
+            }
+            float const w = 1.0f - u - v;
+            glm::vec2 const uv = v0.texCoord * w + v1.texCoord * u 
+              + v2.texCoord * v;
+            bool const isTextured = std::abs(v0.texCoord.x) > 0.0f 
+              || std::abs(v0.texCoord.y) > 0.0f 
+              || std::abs(v1.texCoord.x) > 0.0f 
+              || std::abs(v1.texCoord.y) > 0.0f 
+              || std::abs(v2.texCoord.x) > 0.0f 
+              || std::abs(v2.texCoord.y) > 0.0f;
+            acceptHit(shape, t, instance.objectId, uv, 
+                v0.color * w + v1.color * u + v2.color * v, isTextured, hit);
+          });
+    }
+  }
+
+  static constexpr float nearPlane{0.1f};
+  static constexpr float farPlane{100.0f};
+
+  int32_t const width;
+  int32_t const height;
+  glm::vec2 const overlayScale;
+  WorkerPool &workerPool;
+  RayScene const &scene;
+  std::vector<MeshGeometry> const &meshGeometry;
+  std::vector<uint8_t> colorBuffer;
+  std::vector<float> depthBuffer;
+  std::vector<uint32_t> objectIdBuffer;
+  std::atomic<int32_t> nextBand;
+};
+
+// One camera of a rig that is simulated in a single process. Every camera
+// has its own mount, projection, outputs and render targets, while the GL
+// context, the map and the frame subscription are shared by all of them. The
+// view and isSceneDirty are guarded by the mutex of the frame instances. The
+// left eye of a stereo pair holds the index of its right eye, which is 0 for
+// other cameras, as the first camera is never a right eye. The CPU renderers
+// convert their image into i420Image, outside of the shared memory lock.
+struct RigCamera {
+  uint32_t width;
+  uint32_t height;
+  float fovy;
+  uint32_t freq;
+  glm::vec3 mountPos;
+  float mountYaw;
+  float mountPitch;
+  float mountRoll;
+  std::string nameArgb;
+  std::string nameI420;
+  std::string nameDepth;
+  std::string nameObjectId;
+  uint32_t rightEye;
+  bool isRightEye;
+  uint32_t memSizeArgb;
+  uint32_t memSizeI420;
+  uint32_t i420Rows;
+  std::unique_ptr<cluon::SharedMemory> sharedMemoryArgb;
+  std::unique_ptr<cluon::SharedMemory> sharedMemoryI420;
+  std::unique_ptr<cluon::SharedMemory> sharedMemoryDepth;
+  std::unique_ptr<cluon::SharedMemory> sharedMemoryObjectId;
+  glm::mat4 view;
+  glm::mat4 projP;
+  glm::mat4 projO;
+  float lodPixelScale;
+  bool isSceneDirty;
+  GLuint fbo[2];
+  GLuint tex[2];
+  GLuint rbo;
+  std::vector<ReadbackSlot> readbackSlots;
+  uint32_t readbackIndex;
+  GLuint timerQueries[2];
+  bool timerQueryIssued[2];
+  double sceneMilliseconds;
+  uint32_t tickCount;
+  std::chrono::steady_clock::time_point nextTick;
+  std::unique_ptr<SoftwareRenderer> softwareRenderer;
+  std::unique_ptr<RayCaster> rayCaster;
+  std::vector<uint8_t> i420Image;
+
+  RigCamera():
+    width(),
+    height(),
+    fovy(),
+    freq(),
+    mountPos(),
+    mountYaw(),
+    mountPitch(),
+    mountRoll(),
+    nameArgb(),
+    nameI420(),
+    nameDepth(),
+    nameObjectId(),
+    rightEye(),
+    isRightEye(false),
+    memSizeArgb(),
+    memSizeI420(),
+    i420Rows(),
+    sharedMemoryArgb(),
+    sharedMemoryI420(),
+    sharedMemoryDepth(),
+    sharedMemoryObjectId(),
+    view(1.0f),
+    projP(1.0f),
+    projO(1.0f),
+    lodPixelScale(),
+    isSceneDirty(true),
+    fbo(),
+    tex(),
+    rbo(),
+    readbackSlots(),
+    readbackIndex(),
+    timerQueries(),
+    timerQueryIssued(),
+    sceneMilliseconds(),
+    tickCount(),
+    nextTick(),
+    softwareRenderer(),
+    rayCaster(),
+    i420Image() {}
+};
+
+GLuint buildShaders(std::string const &vertexShaderGlsl,
+    std::string const &fragmentShaderGlsl) {
+  GLuint vertShaderId = glCreateShader(GL_VERTEX_SHADER);
+  {
+
+    char const *vertSourcePtr = vertexShaderGlsl.c_str();
+    glShaderSource(vertShaderId, 1, &vertSourcePtr, nullptr);
+    glCompileShader(vertShaderId);
+
+    int32_t infoLogLen;
+    GLint res = GL_FALSE;
     glGetShaderiv(vertShaderId, GL_COMPILE_STATUS, &res);
     glGetShaderiv(vertShaderId, GL_INFO_LOG_LENGTH, &infoLogLen);
 
@@ -483,38 +3634,401 @@ GLuint buildShaders(std::string const &vertexShaderGlsl,
   return programId;
 }
 
+// Creates a GL context through GLX, along with the window showing the preview.
+bool createGlxContext(GlContext &context, uint32_t width, uint32_t height,
+    bool showWindow, bool verbose)
+{
+  Display *display = XOpenDisplay(nullptr);
+  context.display = display;
+  if (!display) {
+    std::cerr << "Could not open X display" << std::endl;
+    return false;
+  }
+
+  static int32_t visualAttribs[] =
+    {
+      GLX_X_RENDERABLE    , True,
+      GLX_DRAWABLE_TYPE   , GLX_WINDOW_BIT,
+      GLX_RENDER_TYPE     , GLX_RGBA_BIT,
+      GLX_X_VISUAL_TYPE   , GLX_TRUE_COLOR,
+      GLX_RED_SIZE        , 8,
+      GLX_GREEN_SIZE      , 8,
+      GLX_BLUE_SIZE       , 8,
+      GLX_ALPHA_SIZE      , 8,
+      GLX_DEPTH_SIZE      , 24,
+      GLX_STENCIL_SIZE    , 8,
+      GLX_DOUBLEBUFFER    , True,
+      //GLX_SAMPLE_BUFFERS  , 1,
+      //GLX_SAMPLES         , 4,
+      None
+    };
+
+  int32_t glxMajor;
+  int32_t glxMinor;
+ 
+  if (!glXQueryVersion(display, &glxMajor, &glxMinor) ||
+      ((glxMajor == 1 ) && (glxMinor < 3)) || (glxMajor < 1)) {
+    std::cerr << "Invalid GLX version" << std::endl;
+    return false;
+  }
+
+  int32_t fbcount;
+  GLXFBConfig *fbc = glXChooseFBConfig(display, DefaultScreen(display), 
+      visualAttribs, &fbcount);
+  if (!fbc) {
+    std::cerr << "Failed to retrieve a framebuffer config" << std::endl;
+    return false;
+  }
+  if (verbose) {
+    std::clog << "Found " << fbcount << " matching FB configs" << std::endl;
+  }
+
+  int32_t bestFbc = -1;
+  int32_t worstFbc = -1;
+  int32_t bestNumSamp = -1;
+  int32_t worstNumSamp = 999;
+
+  for (int32_t i{0}; i < fbcount; ++i) {
+    XVisualInfo *vi = glXGetVisualFromFBConfig(display, fbc[i]);
+    if (vi) {
+      int32_t sampBuf;
+      int32_t samples;
+      glXGetFBConfigAttrib(display, fbc[i], GLX_SAMPLE_BUFFERS, &sampBuf);
+      glXGetFBConfigAttrib(display, fbc[i], GLX_SAMPLES, &samples);
+
+      if (verbose) {
+        std::clog << "Matching fbconfig " << i << ", visual ID " 
+          << vi->visualid << ": SAMPLE_BUFFERS = " << sampBuf << ", SAMPLES = "
+          << samples << std::endl;
+      }
+      
+      if (bestFbc < 0 || (sampBuf && samples > bestNumSamp)) {
+        bestFbc = i;
+        bestNumSamp = samples;
+      }
+      if (worstFbc < 0 || (!sampBuf || samples < worstNumSamp)) {
+        worstFbc = i;
+        worstNumSamp = samples;
+      }
+    }
+    XFree(vi);
+  }
+
+  GLXFBConfig bestFbConfig = fbc[bestFbc];
+  XFree(fbc);
+
+  XVisualInfo *vi = glXGetVisualFromFBConfig(display, bestFbConfig);
+  if (verbose) {
+    std::clog << "Selected visual ID = " << vi->visualid << std::endl;
+  }
+
+  XSetWindowAttributes swa;
+  swa.colormap = XCreateColormap(display, RootWindow(display, vi->screen),
+      vi->visual, AllocNone);
+  swa.background_pixmap = None;
+  swa.border_pixel = 0;
+  swa.event_mask = StructureNotifyMask;
+  
+  Colormap cmap = swa.colormap;;
+
+  Window win = XCreateWindow(display, RootWindow(display, vi->screen), 0, 0,
+      width, height, 0, vi->depth, InputOutput, vi->visual, 
+      CWBorderPixel | CWColormap | CWEventMask, &swa);
+  if (!win) {
+    std::cerr << "Failed to create window" << std::endl;
+  }
+
+  XFree(vi);
+  context.win = win;
+  context.cmap = cmap;
+  if (showWindow) {
+    XMapWindow(display, win);
+  }
+
+  char const *glxExts = glXQueryExtensionsString(display, 
+      DefaultScreen(display));
+
+  glXCreateContextAttribsARBProc glXCreateContextAttribsARB = 0;
+  glXCreateContextAttribsARB = (glXCreateContextAttribsARBProc)
+    glXGetProcAddressARB((GLubyte const *) "glXCreateContextAttribsARB");
+
+  GLXContext ctx = 0;
+
+  ctxErrorOccurred = false;
+  int32_t (*oldHandler)(Display *, XErrorEvent *) = 
+    XSetErrorHandler(&ctxErrorHandler);
+
+  if (!isExtensionSupported(glxExts, "GLX_ARB_create_context") ||
+      !glXCreateContextAttribsARB) {
+    if (verbose) {
+      std::clog << "Reverint to old GL context" << std::endl;
+    }
+    ctx = glXCreateNewContext(display, bestFbConfig, GLX_RGBA_TYPE, 0, True);
+  } else {
+    int32_t contextAttribs[] =
+      {
+        GLX_CONTEXT_MAJOR_VERSION_ARB, 3,
+        GLX_CONTEXT_MINOR_VERSION_ARB, 0,
+        //GLX_CONTEXT_FLAGS_ARB      , GLX_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB,
+        None
+      };
+
+    ctx = glXCreateContextAttribsARB(display, bestFbConfig, 0, True,
+        contextAttribs);
+
+    XSync(display, False);
+    if (!ctxErrorOccurred && ctx) {
+      if (verbose) {
+        std::clog << "Created context" << std::endl;
+      }
+    } else {
+      contextAttribs[1] = 1;
+      contextAttribs[3] = 0;
+
+      ctxErrorOccurred = false;
+
+      ctx = glXCreateContextAttribsARB(display, bestFbConfig, 0, True,
+          contextAttribs);
+    }
+  }
+  
+  XSync(display, False);
+  XSetErrorHandler(oldHandler);
+
+  if (ctxErrorOccurred || !ctx) {
+    std::cerr << "Failed to create an OpenGL context" << std::endl;
+    return false;
+  }
+  context.glxContext = ctx;
+
+  if (!glXIsDirect(display, ctx)) {
+    if (verbose) {
+      std::clog << "Indirect GLX rendering context obtained" << std::endl;
+    }
+  } 
+
+  glXMakeCurrent(display, win, ctx);
+  return true;
+}
+
+// Creates a GL context through EGL, which needs no display server. Mesa's
+// surfaceless platform is preferred, and otherwise the default display is
+// used. Everything is rendered into framebuffer objects, so the context is
+// made current without a surface, or with a minimal pbuffer if the driver
+// cannot do without.
+#if defined(HAVE_EGL)
+bool createEglContext(GlContext &context, bool verbose)
+{
+  char const *clientExts = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+  PFNEGLGETPLATFORMDISPLAYEXTPROC eglGetPlatformDisplayEXT = 
+    reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(
+        eglGetProcAddress("eglGetPlatformDisplayEXT"));
+  if (clientExts != nullptr && eglGetPlatformDisplayEXT != nullptr
+      && isExtensionSupported(clientExts, "EGL_MESA_platform_surfaceless")) {
+    context.eglDisplay = eglGetPlatformDisplayEXT(
+        EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+  }
+  if (context.eglDisplay == EGL_NO_DISPLAY) {
+    context.eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+  }
+
+  EGLint eglMajor;
+  EGLint eglMinor;
+  if (context.eglDisplay == EGL_NO_DISPLAY 
+      || !eglInitialize(context.eglDisplay, &eglMajor, &eglMinor)) {
+    std::cerr << "Could not initialize an EGL display" << std::endl;
+    context.eglDisplay = EGL_NO_DISPLAY;
+    return false;
+  }
+  if (!eglBindAPI(EGL_OPENGL_API)) {
+    std::cerr << "EGL does not support OpenGL" << std::endl;
+    return false;
+  }
+
+  char const *displayExts = eglQueryString(context.eglDisplay, 
+      EGL_EXTENSIONS);
+  bool const isSurfaceless{displayExts != nullptr 
+    && isExtensionSupported(displayExts, "EGL_KHR_surfaceless_context")};
+
+  EGLint const configAttribs[] = 
+    {
+      EGL_SURFACE_TYPE    , isSurfaceless ? 0 : EGL_PBUFFER_BIT,
+      EGL_RENDERABLE_TYPE , EGL_OPENGL_BIT,
+      EGL_RED_SIZE        , 8,
+      EGL_GREEN_SIZE      , 8,
+      EGL_BLUE_SIZE       , 8,
+      EGL_ALPHA_SIZE      , 8,
+      EGL_NONE
+    };
+  EGLConfig config;
+  EGLint configCount;
+  if (!eglChooseConfig(context.eglDisplay, configAttribs, &config, 1, 
+        &configCount) || configCount == 0) {
+    std::cerr << "Failed to retrieve an EGL config" << std::endl;
+    return false;
+  }
+
+  EGLint const contextAttribs[] =
+    {
+      EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+      EGL_CONTEXT_MINOR_VERSION_KHR, 0,
+      EGL_NONE
+    };
+  context.eglContext = eglCreateContext(context.eglDisplay, config, 
+      EGL_NO_CONTEXT, contextAttribs);
+  if (context.eglContext == EGL_NO_CONTEXT) {
+    std::cerr << "Failed to create an EGL context" << std::endl;
+    return false;
+  }
+
+  if (!isSurfaceless) {
+    EGLint const pbufferAttribs[] = {EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE};
+    context.eglSurface = eglCreatePbufferSurface(context.eglDisplay, config,
+        pbufferAttribs);
+  }
+  if (!eglMakeCurrent(context.eglDisplay, context.eglSurface, 
+        context.eglSurface, context.eglContext)) {
+    std::cerr << "Failed to make the EGL context current" << std::endl;
+    return false;
+  }
+  context.isEgl = true;
+
+  if (verbose) {
+    std::clog << "Created " << (isSurfaceless ? "surfaceless" : "pbuffer") 
+      << " EGL " << eglMajor << "." << eglMinor << " context" << std::endl;
+  }
+  return true;
+}
+#else
+bool createEglContext(GlContext &, bool)
+{
+  std::cerr << "Built without EGL" << std::endl;
+  return false;
+}
+#endif
+
+// Releases whatever parts of either kind of context have been created.
+void destroyGlContext(GlContext &context)
+{
+#if defined(HAVE_EGL)
+  if (context.eglDisplay != EGL_NO_DISPLAY) {
+    eglMakeCurrent(context.eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE,
+        EGL_NO_CONTEXT);
+    if (context.eglSurface != EGL_NO_SURFACE) {
+      eglDestroySurface(context.eglDisplay, context.eglSurface);
+    }
+    if (context.eglContext != EGL_NO_CONTEXT) {
+      eglDestroyContext(context.eglDisplay, context.eglContext);
+    }
+    eglTerminate(context.eglDisplay);
+    context.eglDisplay = EGL_NO_DISPLAY;
+  }
+#endif
+  if (context.display != nullptr) {
+    glXMakeCurrent(context.display, 0, 0);
+    if (context.glxContext != 0) {
+      glXDestroyContext(context.display, context.glxContext);
+    }
+    if (context.win != 0) {
+      XDestroyWindow(context.display, context.win);
+      XFreeColormap(context.display, context.cmap);
+    }
+    XCloseDisplay(context.display);
+    context.display = nullptr;
+  }
+}
+
 int32_t main(int32_t argc, char **argv) {
   int32_t retCode{EXIT_SUCCESS};
   auto commandlineArguments = cluon::getCommandlineArguments(argc, argv);
   if (0 == commandlineArguments.count("cid") 
       || 0 == commandlineArguments.count("map-path") 
       || 0 == commandlineArguments.count("map-path") 
-      || 0 == commandlineArguments.count("freq") 
-      || 0 == commandlineArguments.count("width") 
-      || 0 == commandlineArguments.count("height")
-      || 0 == commandlineArguments.count("fovy")) {
+      || (0 == commandlineArguments.count("rig")
+        && (0 == commandlineArguments.count("freq") 
+          || 0 == commandlineArguments.count("width") 
+          || 0 == commandlineArguments.count("height")
+          || 0 == commandlineArguments.count("fovy")))) {
     std::cerr << argv[0] << " simulates a camera sensor." << std::endl;
     std::cerr << "Usage:   " << argv[0] << std::endl
       << "  --cid=<OD4 session> " << std::endl
       << "  --map-path=<Folder where the map is stored> " << std::endl
-      << "  --freq=<Frequency of camera> " << std::endl
+      << "  --freq=<Frequency of camera in whole Hz, at least 1> " << std::endl
       << "  --width=<Width of the output image> " << std::endl
       << "  --height=<Height of the output image> " << std::endl
       << "  --fovy=<Camera vertical field of view> " << std::endl
-      << "  [--timemod=<Time scale modifier for simulation speed, "
+      << "  [--timemod=<Positive time scale modifier for simulation speed, "
       << "default: 1.0>] "
       << "  [--frame-id=<The frame to use for the true position, default: 0>] " 
       << std::endl
       << "  [--x=<Mount X position (forward), default: 0.0>] " << std::endl
       << "  [--y=<Mount Y position (left), default: 0.0>] " << std::endl
       << "  [--z=<Mount Z position (up), default: 0.0>] " << std::endl
-      << "  [--yaw=<Mount yaw angle, default: 0.0>] " << std::endl
+      << "  [--yaw=<Mount yaw angle (left of the vehicle heading), "
+      << "default: 0.0>] " << std::endl
       << "  [--pitch=<Mount pitch angle, default: 0.0>] " << std::endl
       << "  [--roll=<Mount roll angle, default: 0.0>] " << std::endl
       << "  [--name.i420=<Shared memory for I420 data, default: video0.i420>] " 
       << std::endl
       << "  [--name.argb=<Shared memory for ARGB data, default: video0.argb>] "
       << std::endl
+      << "  [--pose-trigger (Render as soon as the frame of the camera "
+      << "arrives, at most at the given frequency, instead of on a timer)]" 
+      << std::endl
+      << "  [--pose-decimation=<Only render on every n-th frame of the "
+      << "camera when pose triggered, default: 1>] " << std::endl
+      << "  [--readback-depth=<Number of frames read back asynchronously, "
+      << "each adds one frame of latency but lets rendering overlap the "
+      << "readback, default: 1>] " << std::endl
+      << "  [--copy-threads=<Number of threads copying images into shared "
+      << "memory, default: up to 4>] " << std::endl
+      << "  [--depth-prepass (Draw the depth of all opaque geometry before "
+      << "shading it, so that hidden fragments are never shaded)]" 
+      << std::endl
+      << "  [--always-render (Render every tick, even if the scene did not "
+      << "change since the last one)]" << std::endl
+      << "  [--bake-static (Merge all static model and block instances into "
+      << "world space geometry at load, one draw call per texture array)]" 
+      << std::endl
+      << "  [--lod-levels=<Number of simplified levels of detail generated "
+      << "per model, 0 to 3, default: 3>] " << std::endl
+      << "  [--lod-pixel-error=<Largest on-screen size in pixels of the "
+      << "simplification of a level of detail, default: 1.0>] " << std::endl
+      << "  [--texture-view-distance=<Closest distance in metres textures "
+      << "are resolved from, they are downscaled to what the camera sees "
+      << "there, 0 to keep full resolution, default: 1.0>] " << std::endl
+      << "  [--max-texture-size=<Largest texture width and height in texels, "
+      << "default: unlimited>] " << std::endl
+      << "  [--compress-textures (Store textures S3TC compressed, converted "
+      << "once into cache files next to the map textures)]" << std::endl
+      << "  [--backend=<Creates the GL context through egl, which needs no X "
+      << "server but has no preview window, or glx, default: auto, which is "
+      << "egl unless verbose and falls back to glx>] " << std::endl
+      << "  [--renderer=<Renders the scene through gl, or on the CPU by "
+      << "rasterising in software or by raycast, which both still load the "
+      << "map through a GL context, default: gl>] " << std::endl
+      << "  [--render-threads=<Number of threads rendering on the CPU, "
+      << "default: one per core>] " << std::endl
+      << "  [--name.depth=<Shared memory for the view depth in metres of "
+      << "every pixel as 32 bit floats, raycast only>] " << std::endl
+      << "  [--name.object-id=<Shared memory for the object id of every "
+      << "pixel as 32 bit integers, raycast only>] " << std::endl
+      << "  [--stereo-baseline=<Distance in metres to a right eye rendered "
+      << "to the right of the camera in the same tick, from the same frame>] "
+      << std::endl
+      << "  [--name.right.i420=<Shared memory for the right eye's I420 image, "
+      << "default: video0.right.i420, or videon.right.i420 in a rig; "
+      << "likewise name.right.argb, name.right.depth and "
+      << "name.right.object-id>] " << std::endl
+      << "  [--rig=<JSON file with a list 'cameras' of cameras to simulate in "
+      << "this process, sharing the map and the GL context. Each may set x, "
+      << "y, z, yaw, pitch, roll, fovy, width, height, freq, stereo-baseline "
+      << "and the shared memory names, and takes the rest from the "
+      << "arguments here. Shared memories of camera n default to videon.*. "
+      << "Overlays are placed on the first camera's image size and scaled "
+      << "to the others. Freq, width, height and fovy may be left out when "
+      << "given by the rig>] " 
+      << std::endl
       << "  [--verbose]" << std::endl << std::endl
       << "Example: " << argv[0] << " --cid=111 --frame-id=0 "
       << "--map-path=../resource/example_map --x=1.3 --z=0.5 "
@@ -522,216 +4036,228 @@ int32_t main(int32_t argc, char **argv) {
       << std::endl;
     retCode = 1;
   } else {
-    std::string const mapPath{commandlineArguments["map-path"]};
-    std::string const nameI420{(commandlineArguments["name.i420"].size() != 0) 
-      ? commandlineArguments["name.i420"] : "video0.i420"};
-    std::string const nameArgb{(commandlineArguments["name.argb"].size() != 0) 
-      ? commandlineArguments["name.argb"] : "video0.argb"};
-    uint32_t const freq = std::stoi(commandlineArguments["freq"]);
-    float const timemod = (commandlineArguments["timemod"].size() != 0) 
-      ? std::stof(commandlineArguments["timemod"]) : 1.0f;
-    uint32_t const width = std::stoi(commandlineArguments["width"]);
-    uint32_t const height = std::stoi(commandlineArguments["height"]);
-    float const fovy = std::stof(commandlineArguments["fovy"]);
-    uint16_t const cid = std::stoi(commandlineArguments["cid"]);
-    uint32_t const frameId = (commandlineArguments["frame-id"].size() != 0)
-      ? std::stoi(commandlineArguments["frame-id"]) : 0;
-    bool const verbose{commandlineArguments.count("verbose") != 0};
-
-    float const aspect = static_cast<float>(width) / static_cast<float>(height);
-    
-    glm::vec3 mountPos((commandlineArguments["x"].size() != 0) 
-        ? std::stod(commandlineArguments["x"]) : 0.0,
-        (commandlineArguments["y"].size() != 0) 
-        ? std::stod(commandlineArguments["y"]) : 0.0,
-        (commandlineArguments["z"].size() != 0) 
-        ? std::stod(commandlineArguments["z"]) : 0.0);
-    glm::quat mountRot(glm::vec3(
-        (commandlineArguments["roll"].size() != 0) 
-        ? std::stod(commandlineArguments["roll"]) : 0.0,
-        (commandlineArguments["pitch"].size() != 0) 
-        ? std::stod(commandlineArguments["pitch"]) : 0.0,
-        (commandlineArguments["yaw"].size() != 0) 
-        ? std::stod(commandlineArguments["yaw"]) : 0.0));
-
-    uint32_t const memSize = width * height * 4;
-    cluon::SharedMemory sharedMemoryArgb(nameArgb, memSize);
-    cluon::SharedMemory sharedMemoryI420(nameI420, memSize);
-    if (verbose) {
-      std::clog << "Created shared memory " << nameArgb << " (" << memSize 
-        << " bytes) for an ARGB image (width = " << width << ", height = " 
-        << height << ")." << std::endl;
-      std::clog << "Created shared memory " << nameI420 << " (" << memSize 
-        << " bytes) for an I420 image (width = " << width << ", height = " 
-        << height << ")." << std::endl;
-    }
-
-    Display *display = XOpenDisplay(nullptr);
-    if (!display) {
-      std::cerr << "Could not open X display" << std::endl;
-      return -1;
-    }
-
-    static int32_t visualAttribs[] =
-      {
-        GLX_X_RENDERABLE    , True,
-        GLX_DRAWABLE_TYPE   , GLX_WINDOW_BIT,
-        GLX_RENDER_TYPE     , GLX_RGBA_BIT,
-        GLX_X_VISUAL_TYPE   , GLX_TRUE_COLOR,
-        GLX_RED_SIZE        , 8,
-        GLX_GREEN_SIZE      , 8,
-        GLX_BLUE_SIZE       , 8,
-        GLX_ALPHA_SIZE      , 8,
-        GLX_DEPTH_SIZE      , 24,
-        GLX_STENCIL_SIZE    , 8,
-        GLX_DOUBLEBUFFER    , True,
-        //GLX_SAMPLE_BUFFERS  , 1,
-        //GLX_SAMPLES         , 4,
-        None
-      };
-
-    int32_t glxMajor;
-    int32_t glxMinor;
-   
-    if (!glXQueryVersion(display, &glxMajor, &glxMinor) ||
-        ((glxMajor == 1 ) && (glxMinor < 3)) || (glxMajor < 1)) {
-      std::cerr << "Invalid GLX version" << std::endl;
-      return -1;
-    }
-
-    int32_t fbcount;
-    GLXFBConfig *fbc = glXChooseFBConfig(display, DefaultScreen(display), 
-        visualAttribs, &fbcount);
-    if (!fbc) {
-      std::cerr << "Failed to retrieve a framebuffer config" << std::endl;
+    std::string const mapPath{commandlineArguments["map-path"]};
+    float const timemod = (commandlineArguments["timemod"].size() != 0) 
+      ? std::stof(commandlineArguments["timemod"]) : 1.0f;
+    if (!(timemod > 0.0f)) {
+      std::cerr << "The timemod must be positive" << std::endl;
       return -1;
     }
-    if (verbose) {
-      std::clog << "Found " << fbcount << " matching FB configs" << std::endl;
+    uint16_t const cid = std::stoi(commandlineArguments["cid"]);
+    uint32_t const frameId = (commandlineArguments["frame-id"].size() != 0)
+      ? std::stoi(commandlineArguments["frame-id"]) : 0;
+    bool const poseTrigger{commandlineArguments.count("pose-trigger") != 0};
+    uint32_t const poseDecimation = std::max(1,
+        (commandlineArguments["pose-decimation"].size() != 0) 
+        ? std::stoi(commandlineArguments["pose-decimation"]) : 1);
+    // When rendering on poses, images are published as soon as they are read
+    // back, as a deeper readback would hold them until the next pose.
+    uint32_t const readbackDepth = poseTrigger ? 1 : std::max(1, 
+        (commandlineArguments["readback-depth"].size() != 0) 
+        ? std::stoi(commandlineArguments["readback-depth"]) : 1);
+    uint32_t const copyThreads = std::max(1,
+        (commandlineArguments["copy-threads"].size() != 0) 
+        ? std::stoi(commandlineArguments["copy-threads"]) 
+        : std::min(4, 
+          static_cast<int32_t>(std::thread::hardware_concurrency())));
+    bool const alwaysRender{commandlineArguments.count("always-render") != 0};
+    bool const bakeStatic{commandlineArguments.count("bake-static") != 0};
+    bool const depthPrepass{commandlineArguments.count("depth-prepass") != 0};
+    uint32_t const lodLevels = (commandlineArguments["lod-levels"].size() != 0)
+      ? std::stoi(commandlineArguments["lod-levels"]) : 3;
+    float const lodPixelError = 
+      (commandlineArguments["lod-pixel-error"].size() != 0)
+      ? std::stof(commandlineArguments["lod-pixel-error"]) : 1.0f;
+    float const textureViewDistance = 
+      (commandlineArguments["texture-view-distance"].size() != 0)
+      ? std::stof(commandlineArguments["texture-view-distance"]) : 1.0f;
+    uint32_t const maxTextureSize = 
+      (commandlineArguments["max-texture-size"].size() != 0)
+      ? std::stoi(commandlineArguments["max-texture-size"]) : 0;
+    bool const compressTextures{
+      commandlineArguments.count("compress-textures") != 0};
+    std::string const backend{(commandlineArguments["backend"].size() != 0)
+      ? commandlineArguments["backend"] : "auto"};
+    std::string const renderer{(commandlineArguments["renderer"].size() != 0)
+      ? commandlineArguments["renderer"] : "gl"};
+    bool const softwareRendering{renderer == "software"};
+    bool const rayCasting{renderer == "raycast"};
+    if (!softwareRendering && !rayCasting && renderer != "gl") {
+      std::cerr << "Unknown renderer '" << renderer << "', using 'gl'" 
+        << std::endl;
     }
+    uint32_t const renderThreads = std::max(1,
+        (commandlineArguments["render-threads"].size() != 0) 
+        ? std::stoi(commandlineArguments["render-threads"]) 
+        : static_cast<int32_t>(std::thread::hardware_concurrency()));
+    bool const verbose{commandlineArguments.count("verbose") != 0};
 
-    int32_t bestFbc = -1;
-    int32_t worstFbc = -1;
-    int32_t bestNumSamp = -1;
-    int32_t worstNumSamp = 999;
-
-    for (int32_t i{0}; i < fbcount; ++i) {
-      XVisualInfo *vi = glXGetVisualFromFBConfig(display, fbc[i]);
-      if (vi) {
-        int32_t sampBuf;
-        int32_t samples;
-        glXGetFBConfigAttrib(display, fbc[i], GLX_SAMPLE_BUFFERS, &sampBuf);
-        glXGetFBConfigAttrib(display, fbc[i], GLX_SAMPLES, &samples);
-
-        if (verbose) {
-          std::clog << "Matching fbconfig " << i << ", visual ID " 
-            << vi->visualid << ": SAMPLE_BUFFERS = " << sampBuf << ", SAMPLES = "
-            << samples << std::endl;
-        }
-        
-        if (bestFbc < 0 || (sampBuf && samples > bestNumSamp)) {
-          bestFbc = i;
-          bestNumSamp = samples;
-        }
-        if (worstFbc < 0 || (!sampBuf || samples < worstNumSamp)) {
-          worstFbc = i;
-          worstNumSamp = samples;
-        }
-      }
-      XFree(vi);
+    // Without a rig file, the command line describes the only camera.
+    nlohmann::json rigCameras = nlohmann::json::array(
+        {nlohmann::json::object()});
+    if (commandlineArguments["rig"].size() != 0) {
+      nlohmann::json rigJson;
+      std::ifstream i(commandlineArguments["rig"]);
+      i >> rigJson;
+      rigCameras = rigJson["cameras"];
     }
-
-    GLXFBConfig bestFbConfig = fbc[bestFbc];
-    XFree(fbc);
-
-    XVisualInfo *vi = glXGetVisualFromFBConfig(display, bestFbConfig);
-    if (verbose) {
-      std::clog << "Selected visual ID = " << vi->visualid << std::endl;
+    if (rigCameras.empty()) {
+      std::cerr << "The rig has no cameras" << std::endl;
+      return -1;
     }
-
-    XSetWindowAttributes swa;
-    swa.colormap = XCreateColormap(display, RootWindow(display, vi->screen),
-        vi->visual, AllocNone);
-    swa.background_pixmap = None;
-    swa.border_pixel = 0;
-    swa.event_mask = StructureNotifyMask;
-    
-    Colormap cmap = swa.colormap;;
-
-    Window win = XCreateWindow(display, RootWindow(display, vi->screen), 0, 0,
-        width, height, 0, vi->depth, InputOutput, vi->visual, 
-        CWBorderPixel | CWColormap | CWEventMask, &swa);
-    if (!win) {
-      std::cerr << "Failed to create window" << std::endl;
+    // Shared memory names are only taken from the command line for the first
+    // camera, as they must differ between cameras.
+    auto argument{[&rigCameras, &commandlineArguments](uint32_t c,
+        std::string const &key) -> std::string {
+      auto const value = rigCameras[c].find(key);
+      if (value != rigCameras[c].end()) {
+        return value->is_string() ? value->get<std::string>() 
+          : value->dump();
+      }
+      return (c == 0 || key.find("name.") != 0) 
+        ? commandlineArguments[key] : "";
+    }};
+    // A camera with a stereo baseline is the left eye of a stereo pair. Its
+    // right eye is added after all cameras of the rig, and is only rendered
+    // together with the left one.
+    uint32_t rightEyeCount{0};
+    for (uint32_t c{0}; c < rigCameras.size(); c++) {
+      if (argument(c, "stereo-baseline").size() != 0) {
+        rightEyeCount++;
+      }
     }
-
-    XFree(vi);
-    if (verbose) {
-      XMapWindow(display, win);
+    std::vector<RigCamera> cameras(rigCameras.size() + rightEyeCount);
+    uint32_t nextRightEye = static_cast<uint32_t>(rigCameras.size());
+    for (uint32_t c{0}; c < rigCameras.size(); c++) {
+      RigCamera &camera = cameras[c];
+      if (argument(c, "freq").empty() || argument(c, "width").empty() 
+          || argument(c, "height").empty() || argument(c, "fovy").empty()) {
+        std::cerr << "Camera " << c << " has no freq, width, height or fovy" 
+          << std::endl;
+        return -1;
+      }
+      // Cameras tick at whole frequencies, and at least once a second.
+      int32_t const freq = std::stoi(argument(c, "freq"));
+      if (freq < 1) {
+        std::cerr << "Camera " << c << " has a freq below 1 Hz" << std::endl;
+        return -1;
+      }
+      camera.freq = static_cast<uint32_t>(freq);
+      camera.width = std::stoi(argument(c, "width"));
+      camera.height = std::stoi(argument(c, "height"));
+      camera.fovy = std::stof(argument(c, "fovy"));
+
+      camera.mountPos = glm::vec3((argument(c, "x").size() != 0) 
+          ? std::stod(argument(c, "x")) : 0.0,
+          (argument(c, "y").size() != 0) ? std::stod(argument(c, "y")) : 0.0,
+          (argument(c, "z").size() != 0) ? std::stod(argument(c, "z")) : 0.0);
+      camera.mountYaw = (argument(c, "yaw").size() != 0) 
+        ? std::stof(argument(c, "yaw")) : 0.0f;
+      camera.mountPitch = (argument(c, "pitch").size() != 0) 
+        ? std::stof(argument(c, "pitch")) : 0.0f;
+      camera.mountRoll = (argument(c, "roll").size() != 0) 
+        ? std::stof(argument(c, "roll")) : 0.0f;
+
+      std::string const defaultName{"video" + std::to_string(c)};
+      camera.nameI420 = (argument(c, "name.i420").size() != 0) 
+        ? argument(c, "name.i420") : defaultName + ".i420";
+      camera.nameArgb = (argument(c, "name.argb").size() != 0) 
+        ? argument(c, "name.argb") : defaultName + ".argb";
+      camera.nameDepth = argument(c, "name.depth");
+      camera.nameObjectId = argument(c, "name.object-id");
+
+      // The right eye sits the baseline to the right of the left one, along
+      // the rolled and pitched right axis of the mount, and is otherwise the
+      // same camera.
+      if (argument(c, "stereo-baseline").size() != 0) {
+        float const baseline = std::stof(argument(c, "stereo-baseline"));
+        float const cy = std::cos(camera.mountYaw);
+        float const sy = std::sin(camera.mountYaw);
+        float const cp = std::cos(camera.mountPitch);
+        float const sp = std::sin(camera.mountPitch);
+        glm::vec3 const direction(cp * cy, cp * sy, sp);
+        glm::vec3 const level = glm::cross(glm::vec3(sy, -cy, 0.0f), 
+            direction);
+        glm::vec3 const right = std::cos(camera.mountRoll) 
+          * glm::vec3(sy, -cy, 0.0f) - std::sin(camera.mountRoll) * level;
+        camera.rightEye = nextRightEye++;
+        RigCamera &rightEye = cameras[camera.rightEye];
+        rightEye.freq = camera.freq;
+        rightEye.width = camera.width;
+        rightEye.height = camera.height;
+        rightEye.fovy = camera.fovy;
+        rightEye.mountPos = camera.mountPos + baseline * right;
+        rightEye.mountYaw = camera.mountYaw;
+        rightEye.mountPitch = camera.mountPitch;
+        rightEye.mountRoll = camera.mountRoll;
+        rightEye.nameI420 = (argument(c, "name.right.i420").size() != 0) 
+          ? argument(c, "name.right.i420") : defaultName + ".right.i420";
+        rightEye.nameArgb = (argument(c, "name.right.argb").size() != 0) 
+          ? argument(c, "name.right.argb") : defaultName + ".right.argb";
+        rightEye.nameDepth = argument(c, "name.right.depth");
+        rightEye.nameObjectId = argument(c, "name.right.object-id");
+        rightEye.isRightEye = true;
+      }
     }
-
-    char const *glxExts = glXQueryExtensionsString(display, 
-        DefaultScreen(display));
-
-    glXCreateContextAttribsARBProc glXCreateContextAttribsARB = 0;
-    glXCreateContextAttribsARB = (glXCreateContextAttribsARBProc)
-      glXGetProcAddressARB((GLubyte const *) "glXCreateContextAttribsARB");
-
-    GLXContext ctx = 0;
-
-    ctxErrorOccurred = false;
-    int32_t (*oldHandler)(Display *, XErrorEvent *) = 
-      XSetErrorHandler(&ctxErrorHandler);
-
-    if (!isExtensionSupported(glxExts, "GLX_ARB_create_context") ||
-        !glXCreateContextAttribsARB) {
+    for (auto &camera : cameras) {
+      // The I420 image is planar: a full resolution Y plane followed by U
+      // and V planes subsampled by two in both directions. It is produced on
+      // the GPU as a single channel image of i420Rows rows, each width bytes
+      // wide.
+      uint32_t const width{camera.width};
+      uint32_t const height{camera.height};
+      uint32_t const chromaWidth = (width + 1) / 2;
+      uint32_t const chromaHeight = (height + 1) / 2;
+      camera.memSizeArgb = width * height * 4;
+      camera.memSizeI420 = width * height + 2 * chromaWidth * chromaHeight;
+      camera.i420Rows = (camera.memSizeI420 + width - 1) / width;
+      camera.sharedMemoryArgb.reset(new cluon::SharedMemory(camera.nameArgb,
+            camera.memSizeArgb));
+      camera.sharedMemoryI420.reset(new cluon::SharedMemory(camera.nameI420,
+            camera.memSizeI420));
+      if (rayCasting && camera.nameDepth.size() != 0) {
+        camera.sharedMemoryDepth.reset(new cluon::SharedMemory(
+              camera.nameDepth, width * height * 4));
+      }
+      if (rayCasting && camera.nameObjectId.size() != 0) {
+        camera.sharedMemoryObjectId.reset(new cluon::SharedMemory(
+              camera.nameObjectId, width * height * 4));
+      }
       if (verbose) {
-        std::clog << "Reverint to old GL context" << std::endl;
+        std::clog << "Created shared memory " << camera.nameArgb << " (" 
+          << camera.memSizeArgb << " bytes) for an ARGB image (width = " 
+          << width << ", height = " << height << ")." << std::endl;
+        std::clog << "Created shared memory " << camera.nameI420 << " (" 
+          << camera.memSizeI420 << " bytes) for an I420 image (width = " 
+          << width << ", height = " << height << ")." << std::endl;
       }
-      ctx = glXCreateNewContext(display, bestFbConfig, GLX_RGBA_TYPE, 0, True);
-    } else {
-      int32_t contextAttribs[] =
-        {
-          GLX_CONTEXT_MAJOR_VERSION_ARB, 3,
-          GLX_CONTEXT_MINOR_VERSION_ARB, 0,
-          //GLX_CONTEXT_FLAGS_ARB      , GLX_CONTEXT_FORWARD_COMPATIBLE_BIT_ARB,
-          None
-        };
-
-      ctx = glXCreateContextAttribsARB(display, bestFbConfig, 0, True,
-          contextAttribs);
-
-      XSync(display, False);
-      if (!ctxErrorOccurred && ctx) {
-        if (verbose) {
-          std::clog << "Created context" << std::endl;
-        }
-      } else {
-        contextAttribs[1] = 1;
-        contextAttribs[3] = 0;
-
-        ctxErrorOccurred = false;
-
-        ctx = glXCreateContextAttribsARB(display, bestFbConfig, 0, True,
-            contextAttribs);
+    }
+    // Overlays are placed in pixels of the first camera, and scaled to the
+    // image size of the others.
+    uint32_t const overlayWidth{cameras[0].width};
+    uint32_t const overlayHeight{cameras[0].height};
+
+    // EGL is used unless the preview window is wanted, falling back to GLX
+    // when no EGL display can be had.
+    GlContext glContext;
+    bool hasGlContext{false};
+    if (backend == "egl" || (backend == "auto" && !verbose)) {
+      hasGlContext = createEglContext(glContext, verbose);
+      if (!hasGlContext) {
+        destroyGlContext(glContext);
+        glContext = GlContext();
       }
     }
-    
-    XSync(display, False);
-    XSetErrorHandler(oldHandler);
-
-    if (ctxErrorOccurred || !ctx) {
-      std::cerr << "Failed to create an OpenGL context" << std::endl;
+    if (!hasGlContext && backend != "egl") {
+      hasGlContext = createGlxContext(glContext, overlayWidth, overlayHeight,
+          verbose, verbose);
+    }
+    if (!hasGlContext) {
+      destroyGlContext(glContext);
       return -1;
     }
-
-    if (!glXIsDirect(display, ctx)) {
-      if (verbose) {
-        std::clog << "Indirect GLX rendering context obtained" << std::endl;
-      }
-    } 
-
-    glXMakeCurrent(display, win, ctx);
+    // The preview window shows the first camera.
+    bool const showPreview{verbose && !glContext.isEgl};
 
 
     glewInit();
@@ -745,62 +4271,119 @@ int32_t main(int32_t argc, char **argv) {
     
     std::string title = glVendor + ", " + glRenderer + " (" + glVersion + ")";
 
-    XStoreName(display, win, title.c_str());
+    if (glContext.isEgl) {
+      if (verbose) {
+        std::clog << "Rendering with " << title << std::endl;
+      }
+    } else {
+      XStoreName(glContext.display, glContext.win, title.c_str());
+    }
 
     GLuint programId;
-    GLint mvpId;
-    GLint doI420Id;
+    GLint vpId;
+    GLuint depthProgramId;
+    GLint depthVpId;
+    GLuint yuvProgramId;
+    GLint yuvSizeId;
     {
       std::string vertexShaderGlsl = R"(#version 300 es
 
 layout(location = 0) in vec3 position0;
 layout(location = 1) in vec3 color0;
 layout(location = 2) in vec2 uv0;
+layout(location = 3) in vec4 instance0;
+layout(location = 4) in float layer0;
 
 out vec3 color1;
-out vec2 uv1;
+out vec3 uv1;
+
+// The depth pre-pass and the colour pass are separate programs, and must
+// produce identical depths for the equal depth test to pass.
+invariant gl_Position;
 
-uniform mat4 u_mvp;
+uniform mat4 u_vp;
 
 void main()
 {
-  vec4 v = vec4(position0, 1.0);
-  gl_Position = u_mvp * v;
+  float a = 3.14159265 - instance0.w;
+  float c = cos(a);
+  float s = sin(a);
+  vec4 v = vec4(c * position0.x - s * position0.y,
+      s * position0.x + c * position0.y, position0.z, 1.0);
+  v.xyz += instance0.xyz;
+  gl_Position = u_vp * v;
   color1 = color0;
-  uv1 = uv0;
+  uv1 = vec3(uv0, layer0);
 })";
 
       std::string fragmentShaderGlsl = R"(#version 300 es
 precision mediump float;
 precision highp int;
 
-uniform highp sampler2D mySampler;
-uniform bool u_do_i420;
+uniform highp sampler2DArray mySampler;
 
-in highp vec2 uv1;
+in highp vec3 uv1;
 in highp vec3 color1;
-layout(location = 2) out highp vec4 color2;
-
-const mat4 rgbaToYuv = mat4(
-  0.257,  0.439, -0.148, 0.0,
-  0.504, -0.368, -0.291, 0.0,
-  0.098, -0.071,  0.439, 0.0,
-  0.0625, 0.500,  0.500, 1.0
-);
+layout(location = 0) out highp vec4 color2;
 
 void main()
 {
-  highp vec4 rgba;
-  
-  if (any(notEqual(uv1, vec2(0.0)))) {
-    rgba = texture(mySampler, uv1);
+  if (any(notEqual(uv1.xy, vec2(0.0)))) {
+    color2 = texture(mySampler, uv1);
   } else {
-    rgba = vec4(color1, 1.0);
+    color2 = vec4(color1, 1.0);
   }
-  if (u_do_i420) {
-    color2 = rgbaToYuv * rgba;
+})";
+
+      // The depth pre-pass shares the vertex shader but shades nothing.
+      std::string depthFragmentShaderGlsl = R"(#version 300 es
+precision mediump float;
+
+void main()
+{
+})";
+
+      // The I420 image is derived from the rendered ARGB texture by drawing a
+      // single screen covering triangle, instead of rendering the scene twice.
+      // Rows below the Y plane hold the U and V planes packed back to back,
+      // where each chroma sample is the bilinear average of a 2x2 block.
+      std::string yuvVertexShaderGlsl = R"(#version 300 es
+
+void main()
+{
+  vec2 p = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+  gl_Position = vec4(p * 2.0 - 1.0, 0.0, 1.0);
+})";
+
+      std::string yuvFragmentShaderGlsl = R"(#version 300 es
+precision mediump float;
+precision highp int;
+
+uniform highp sampler2D u_argb;
+uniform ivec2 u_size;
+
+layout(location = 0) out highp vec4 color2;
+
+const vec3 rgbToY = vec3(0.257, 0.504, 0.098);
+const vec3 rgbToU = vec3(-0.148, -0.291, 0.439);
+const vec3 rgbToV = vec3(0.439, -0.368, -0.071);
+
+void main()
+{
+  ivec2 p = ivec2(gl_FragCoord.xy);
+  if (p.y < u_size.y) {
+    highp vec3 rgb = texelFetch(u_argb, p, 0).rgb;
+    color2 = vec4(dot(rgbToY, rgb) + 0.0625);
   } else {
-    color2 = rgba;
+    ivec2 chromaSize = (u_size + 1) / 2;
+    int planeSize = chromaSize.x * chromaSize.y;
+    int i = (p.y - u_size.y) * u_size.x + p.x;
+    int plane = i / planeSize;
+    i -= plane * planeSize;
+    highp vec2 uv = (vec2(i % chromaSize.x, i / chromaSize.x) * 2.0 + 1.0)
+      / vec2(u_size);
+    highp vec3 rgb = texture(u_argb, uv).rgb;
+    color2 = vec4(dot(plane == 0 ? rgbToU : rgbToV, rgb) + 0.5);
   }
 })";
 
@@ -810,61 +4393,97 @@ void main()
         std::cerr << "Could not load shaders" << std::endl;
         shaderError = true;
       }
-      mvpId = glGetUniformLocation(programId, "u_mvp");
-      if (!shaderError && mvpId < 0) {
-        std::cerr << "Missing shader uniform 'u_mvp'" << std::endl;
+      vpId = glGetUniformLocation(programId, "u_vp");
+      if (!shaderError && vpId < 0) {
+        std::cerr << "Missing shader uniform 'u_vp'" << std::endl;
+        shaderError = true;
+      }
+      depthProgramId = buildShaders(vertexShaderGlsl, depthFragmentShaderGlsl);
+      if (!shaderError && depthProgramId == 0) {
+        std::cerr << "Could not load depth pre-pass shaders" << std::endl;
+        shaderError = true;
+      }
+      depthVpId = glGetUniformLocation(depthProgramId, "u_vp");
+      if (!shaderError && depthVpId < 0) {
+        std::cerr << "Missing depth pre-pass shader uniform 'u_vp'" 
+          << std::endl;
+        shaderError = true;
+      }
+      yuvProgramId = buildShaders(yuvVertexShaderGlsl, yuvFragmentShaderGlsl);
+      if (!shaderError && yuvProgramId == 0) {
+        std::cerr << "Could not load YUV conversion shaders" << std::endl;
+        shaderError = true;
+      }
+      GLint argbId = glGetUniformLocation(yuvProgramId, "u_argb");
+      if (!shaderError && argbId < 0) {
+        std::cerr << "Missing shader uniform 'u_argb'" << std::endl;
         shaderError = true;
       }
-      doI420Id = glGetUniformLocation(programId, "u_do_i420");
-      if (!shaderError && doI420Id < 0) {
-        std::cerr << "Missing shader uniform 'u_do_i420'" << std::endl;
+      yuvSizeId = glGetUniformLocation(yuvProgramId, "u_size");
+      if (!shaderError && yuvSizeId < 0) {
+        std::cerr << "Missing shader uniform 'u_size'" << std::endl;
         shaderError = true;
       }
+      if (!shaderError) {
+        glUseProgram(yuvProgramId);
+        glUniform1i(argbId, 0);
+        glUseProgram(0);
+      }
       if (shaderError) {
-        glXMakeCurrent(display, 0, 0);
-        glXDestroyContext(display, ctx);
-
-        XDestroyWindow(display, win);
-        XFreeColormap(display, cmap);
-        XCloseDisplay(display);
+        destroyGlContext(glContext);
         return -1;
       }
     }
 
-    GLuint fbo[2];
-    glGenFramebuffers(2, fbo);
-    
-    GLuint tex[2];
-    glGenTextures(2, tex);
-    
-    GLuint rbo[2];
-    glGenRenderbuffers(2, rbo);
-    
-    for (uint32_t i{0}; i < 2; i++) {
-      glBindFramebuffer(GL_DRAW_FRAMEBUFFER, fbo[i]);
-
-      glBindTexture(GL_TEXTURE_2D, tex[i]);
-      glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, 
-          GL_UNSIGNED_BYTE, nullptr);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);  
-      glBindTexture(GL_TEXTURE_2D, 0);
-
-      glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, 
-          GL_TEXTURE_2D, tex[i], 0);
-
-      glBindRenderbuffer(GL_RENDERBUFFER, rbo[i]); 
-      glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width,
-          height);  
-      glBindRenderbuffer(GL_RENDERBUFFER, 0);
-
-      glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT,
-          GL_RENDERBUFFER, rbo[i]);
-    }
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-      std::cerr << "Framebuffer not complete" << std::endl;
+    // The scene of each camera is rendered into its fbo[0] only, so only it
+    // needs a depth buffer. fbo[1] holds the single channel I420 image
+    // converted from tex[0].
+    for (auto &camera : cameras) {
+      glGenFramebuffers(2, camera.fbo);
+      glGenTextures(2, camera.tex);
+      glGenRenderbuffers(1, &camera.rbo);
+      for (uint32_t i{0}; i < 2; i++) {
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, camera.fbo[i]);
+
+        glBindTexture(GL_TEXTURE_2D, camera.tex[i]);
+        if (i == 0) {
+          glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, camera.width, camera.height,
+              0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+        } else {
+          glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, camera.width, camera.i420Rows,
+              0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+        }
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);  
+        // The last chroma sample of an odd sized image lies on the edge, and
+        // must not be blended with the opposite edge.
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, 
+            GL_TEXTURE_2D, camera.tex[i], 0);
+
+        if (i == 0) {
+          glBindRenderbuffer(GL_RENDERBUFFER, camera.rbo); 
+          glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, 
+              camera.width, camera.height);  
+          glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+          glFramebufferRenderbuffer(GL_FRAMEBUFFER, 
+              GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, camera.rbo);
+        }
+        
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) 
+            != GL_FRAMEBUFFER_COMPLETE) {
+          std::cerr << "Framebuffer not complete" << std::endl;
+        }
+      }
     }
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);  
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    GLuint emptyVao;
+    glGenVertexArrays(1, &emptyVao);  
 
 
     nlohmann::json json;
@@ -873,33 +4492,28 @@ void main()
       i >> json;
     }
 
-    struct MeshInstance {
-      std::string name;
-      glm::vec3 position;
-      float rotation;
-      bool visible;
-
-      MeshInstance():
-        name(), position(), rotation(), visible() {}
-
-      MeshInstance(std::string a_name, glm::vec3 a_position, float a_rotation,
-          bool a_visible): 
-        name(a_name), position(a_position), rotation(a_rotation), 
-        visible(a_visible) {}
-    };
-    
-    GLuint vbo[2];
-    glGenBuffers(2, vbo);
-
-    std::vector<MeshInstance> meshInstances;
-    std::map<uint32_t, MeshInstance> meshInstancesFrame;
-    std::map<std::string, MeshHandle> meshHandles;
+    GLuint vbo[5];
+    glGenBuffers(5, vbo);
+
+    MeshInstances meshInstances;
+    MeshInstances meshInstancesFrame;
+    std::map<uint32_t, uint32_t> meshInstancesFrameRow;
+    std::vector<MeshHandle> meshHandles;
+    std::vector<glm::vec4> instanceData;
+    InstanceGrid instanceGrid;
+    // The CPU renderers draw from copies of all meshes and textures.
+    bool const cpuRendering{softwareRendering || rayCasting};
+    std::vector<MeshGeometry> meshGeometry;
+    std::map<GLuint, SoftwareTexture> softwareTextures;
+    RayScene rayScene;
     {
+      std::map<std::string, uint32_t> meshIds;
       std::vector<ModelInfo> modelInfo;
       if (json.find("model") != json.end()) {
         for (auto const &j : json["model"]) {
           std::string name = j["name"];
           std::string file = j["file"];
+          uint32_t const meshId = internMeshName(meshIds, name);
           if (j.find("color") != j.end()) {
             float c0 = j["color"][0];
             float c1 = j["color"][1];
@@ -918,13 +4532,19 @@ void main()
               float y = i[1];
               float z = i[2];
               float a = i[3];
-              meshInstances.push_back({name, glm::vec3(x, y, z), a, true});
+              meshInstances.add(meshId, glm::vec3(x, y, z), a, true);
             }
           }
           if (j.find("frames") != j.end()) {
             for (auto const &i : j["frames"]) {
-              meshInstancesFrame[i] = {name, glm::vec3(0.0f, 0.0f, 0.0f), 0.0f,
-                false};
+              uint32_t const frame = i;
+              auto row = meshInstancesFrameRow.find(frame);
+              if (row == meshInstancesFrameRow.end()) {
+                meshInstancesFrameRow[frame] = meshInstancesFrame.add(meshId, 
+                    glm::vec3(0.0f, 0.0f, 0.0f), 0.0f, false);
+              } else {
+                meshInstancesFrame.meshId[row->second] = meshId;
+              }
             }
           }
         }
@@ -933,6 +4553,7 @@ void main()
       if (json.find("block") != json.end()) {
         for (auto const &j : json["block"]) {
           std::string name = j["name"];
+          uint32_t const meshId = internMeshName(meshIds, name);
           float d0 = j["dimension"][0];
           float d1 = j["dimension"][1];
           float d2 = j["dimension"][2];
@@ -955,36 +4576,98 @@ void main()
             float y = i[1];
             float z = i[2];
             float a = i[3];
-            meshInstances.push_back({name, glm::vec3(x, y, z), a, true});
+            meshInstances.add(meshId, glm::vec3(x, y, z), a, true);
           }
         }
       }
       if (json.find("overlay") != json.end()) {
         for (auto const &j : json["overlay"]) {
           std::string name = j["name"];
-          float d0 = static_cast<float>(j["dimension"][0]) * width;
-          float d1 = static_cast<float>(j["dimension"][1]) * height;
+          uint32_t const meshId = internMeshName(meshIds, name);
+          float d0 = static_cast<float>(j["dimension"][0]) * overlayWidth;
+          float d1 = static_cast<float>(j["dimension"][1]) * overlayHeight;
           std::string textureFile = j["textureFile"];
           blockInfo.push_back({name, glm::vec3(d0, d1, 0.1),
               mapPath + "/" + textureFile, glm::vec2(1.0, 1.0), true});
 
           for (auto const &i : j["instances"]) {
-            float x = static_cast<float>(i[0]) * width + 0.5f * d0;
-            float y = static_cast<float>(i[1]) * height + 0.5f * d1;
-            meshInstances.push_back({name, glm::vec3(x, y, 0.0), 0.0, true});
+            float x = static_cast<float>(i[0]) * overlayWidth + 0.5f * d0;
+            float y = static_cast<float>(i[1]) * overlayHeight + 0.5f * d1;
+            meshInstances.add(meshId, glm::vec3(x, y, 0.0), 0.0f, true);
           }
         }
       }
-      meshHandles = loadModels(modelInfo, blockInfo, vbo, verbose);
+      TextureOptions textureOptions;
+      if (json.find("textureFilter") != json.end()) {
+        std::string const filter = json["textureFilter"];
+        if (filter == "nearest" || filter == "bilinear" 
+            || filter == "trilinear" || filter == "anisotropic") {
+          textureOptions.filter = filter;
+        } else {
+          std::cerr << "Unknown texture filter '" << filter << "', using '" 
+            << textureOptions.filter << "'" << std::endl;
+        }
+      }
+      if (json.find("textureAnisotropy") != json.end()) {
+        textureOptions.anisotropy = json["textureAnisotropy"];
+      }
+      // Textures are resolved for the camera seeing the most detail.
+      if (textureViewDistance > 0.0f) {
+        for (auto const &camera : cameras) {
+          textureOptions.texelsPerMeter = std::max(
+              textureOptions.texelsPerMeter, 
+              0.5f * static_cast<float>(camera.height) 
+              / std::tan(0.5f * glm::radians(camera.fovy)) 
+              / textureViewDistance);
+        }
+      }
+      textureOptions.maxSize = maxTextureSize;
+      textureOptions.compress = compressTextures && !cpuRendering;
+      if (verbose) {
+        std::clog << "Using " << textureOptions.filter 
+          << " texture filtering" << std::endl;
+      }
+      meshHandles = loadModels(modelInfo, blockInfo, meshIds, vbo, lodLevels,
+          textureOptions, 
+          (bakeStatic || cpuRendering) ? &meshGeometry : nullptr,
+          cpuRendering ? &softwareTextures : nullptr, verbose);
+      // The ray caster keeps its own hierarchy over the static instances.
+      if (rayCasting) {
+        rayScene = buildRayScene(meshHandles, meshGeometry, softwareTextures,
+            blockInfo, meshIds, meshInstances, verbose);
+      } else if (bakeStatic) {
+        bakeStaticInstances(meshHandles, meshGeometry, meshInstances, meshIds,
+            &vbo[3], verbose);
+      }
+      loadInstances(meshHandles, meshInstances, meshInstancesFrame, meshIds,
+          vbo[2], instanceData, verbose);
+      instanceGrid = buildInstanceGrid(meshInstances, meshHandles, verbose);
+      if (!assignDrawKeys(meshHandles)) {
+        destroyGlContext(glContext);
+        return -1;
+      }
+      if (!cpuRendering) {
+        meshGeometry.clear();
+        meshGeometry.shrink_to_fit();
+      }
     }
     
     std::mutex meshInstancesFrameMutex;
 
+    // The isSceneDirty flag of a camera is set whenever its view or a frame
+    // instance changes, and cleared once its scene has been rendered.
+
+    // When pose triggered, every poseDecimation-th frame of the camera sets
+    // isPoseReady and wakes the render loop. Guarded by
+    // meshInstancesFrameMutex.
+    bool isPoseReady{false};
+    uint32_t poseCount{0};
+    std::condition_variable poseCondition;
+
     bool hasFrame{false};
-    glm::mat4 view(glm::mat4(1.0f));
-    std::mutex viewMutex;
-    auto onFrame{[&frameId, &mountPos, &mountRot, &view, &viewMutex, &hasFrame,
-    &meshInstancesFrame, &meshInstancesFrameMutex](
+    auto onFrame{[&frameId, &cameras, &hasFrame, &meshInstancesFrame, 
+    &meshInstancesFrameRow, &meshInstancesFrameMutex, &isPoseReady, 
+    &poseCount, &poseCondition, &poseTrigger, &poseDecimation](
         cluon::data::Envelope &&envelope)
       {
         std::lock_guard<std::mutex> lock(meshInstancesFrameMutex);
@@ -995,138 +4678,725 @@ void main()
         double horizontalAngle = hpi - frame.yaw();
 
         uint32_t const senderStamp = envelope.senderStamp();
+        bool poseArrived{false};
         if (frameId == senderStamp) {
-          glm::vec3 position = framePos + mountPos;
-
-          double verticalAngle = frame.pitch() + mountRot.y; 
-
-          glm::vec3 direction(
-              std::cos(verticalAngle) * std::sin(horizontalAngle), 
-              std::cos(verticalAngle) * std::cos(horizontalAngle),
-              std::sin(verticalAngle));
-
-          glm::vec3 right = glm::vec3(std::sin(horizontalAngle + hpi),
-              std::cos(horizontalAngle + hpi), 0);
-          glm::vec3 up = glm::cross(right, direction);
-
-          glm::vec3 positionFlip(position.x, position.y, position.z);
-          view = glm::lookAt(positionFlip, positionFlip + direction, up);
+          // The mounts of the cameras turn with the vehicle.
+          double const c = std::cos(frame.yaw());
+          double const s = std::sin(frame.yaw());
+          for (auto &camera : cameras) {
+            glm::vec3 const &mount = camera.mountPos;
+            glm::vec3 position = framePos + glm::vec3(
+                c * mount.x - s * mount.y, s * mount.x + c * mount.y, mount.z);
+            double const cameraAngle = horizontalAngle - camera.mountYaw;
+
+            double verticalAngle = frame.pitch() + camera.mountPitch; 
+
+            glm::vec3 direction(
+                std::cos(verticalAngle) * std::sin(cameraAngle), 
+                std::cos(verticalAngle) * std::cos(cameraAngle),
+                std::sin(verticalAngle));
+
+            glm::vec3 right = glm::vec3(std::sin(cameraAngle + hpi),
+                std::cos(cameraAngle + hpi), 0);
+            glm::vec3 level = glm::cross(right, direction);
+
+            // A positive mount roll tips the camera to its right.
+            float const cr = std::cos(camera.mountRoll);
+            float const sr = std::sin(camera.mountRoll);
+            glm::vec3 up = cr * level + sr * right;
+
+            glm::vec3 positionFlip(position.x, position.y, position.z);
+            glm::mat4 const frameView = glm::lookAt(positionFlip, 
+                positionFlip + direction, up);
+            if (!hasFrame 
+                || memcmp(&frameView, &camera.view, sizeof(frameView)) != 0) {
+              camera.view = frameView;
+              camera.isSceneDirty = true;
+            }
+          }
 
           hasFrame = true;
+          poseArrived = (poseCount++ % poseDecimation == 0);
+        }
+
+        auto row = meshInstancesFrameRow.find(senderStamp);
+        if (row != meshInstancesFrameRow.end()) {
+          float const rotation = static_cast<float>(horizontalAngle);
+          glm::vec3 &position = meshInstancesFrame.position[row->second];
+          float &previousRotation = meshInstancesFrame.rotation[row->second];
+          if (!meshInstancesFrame.visible[row->second] 
+              || memcmp(&position, &framePos, sizeof(framePos)) != 0
+              || memcmp(&previousRotation, &rotation, sizeof(rotation)) != 0) {
+            meshInstancesFrame.visible[row->second] = true;
+            position = framePos;
+            previousRotation = rotation;
+            for (auto &camera : cameras) {
+              camera.isSceneDirty = true;
+            }
+          }
         }
 
-        if (meshInstancesFrame.find(senderStamp) != meshInstancesFrame.end()) {
-          meshInstancesFrame[senderStamp].visible = true;
-          meshInstancesFrame[senderStamp].position = framePos;
-          meshInstancesFrame[senderStamp].rotation = 
-            static_cast<float>(horizontalAngle);
+        if (poseTrigger && poseArrived) {
+          isPoseReady = true;
+          poseCondition.notify_one();
         }
       }};
 
-    glm::mat4 projP = glm::perspective(glm::radians(fovy), aspect, 0.1f,
-        100.0f);
-    glm::mat4 projO = glm::ortho(0.0f, static_cast<float>(width),
-        static_cast<float>(height), 0.0f, -1.0f, 1.0f);
-    auto drawScene{[&hasFrame, &meshInstances, &meshHandles, &mvpId,
-      &projP, &projO, &view, &viewMutex, &meshInstancesFrame,
-      &meshInstancesFrameMutex]() {
-      glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    for (auto &camera : cameras) {
+      float const aspect = static_cast<float>(camera.width) 
+        / static_cast<float>(camera.height);
+      // The images in shared memory are stored top row first, so the scene
+      // is rendered upside down into the framebuffer objects.
+      camera.projP = glm::perspective(glm::radians(camera.fovy), aspect, 0.1f,
+          100.0f) * glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, 1.0f));
+      // Pixels covered by one meter at one meter distance, scaled by the
+      // allowed level of detail error.
+      camera.lodPixelScale = 0.5f * static_cast<float>(camera.height) 
+        / std::tan(0.5f * glm::radians(camera.fovy)) / lodPixelError;
+      camera.projO = glm::ortho(0.0f, static_cast<float>(overlayWidth),
+          static_cast<float>(overlayHeight), 0.0f, -1.0f, 1.0f);
+    }
+    DrawStats drawStats;
+    GlStateCache glStateCache;
+    std::vector<uint64_t> drawList;
+    drawList.reserve(meshHandles.size());
+    std::vector<std::pair<float, glm::vec4>> sortedInstances;
+    glm::mat4 vpP(1.0f);
+
+    // Culls the instances as seen by a camera and selects their levels of
+    // detail into instanceData, and lists the draws in drawList, sorted by
+    // their keys. The list is left empty until the first frame has arrived.
+    // The view projection of the camera is left in vpP, and that of its right
+    // eye, if any, in vpRight. Both eyes are taken from the same frame and
+    // share the culling, levels of detail and draw order of the left eye.
+    glm::mat4 vpRight(1.0f);
+    auto prepareScene{[&hasFrame, &meshHandles, &meshInstances,
+      &instanceGrid, &instanceData, &drawList, &sortedInstances, &vpP, 
+      &vpRight, &meshInstancesFrame, &meshInstancesFrameMutex, 
+      &drawStats](RigCamera const &camera, RigCamera const *rightEye) {
+      drawStats = DrawStats();
+      drawList.clear();
 
       if (hasFrame) {
         std::lock_guard<std::mutex> lock(meshInstancesFrameMutex);
-        std::vector<MeshInstance> mis = meshInstances;
-            
-        for (auto const &mi : meshInstancesFrame) {
-          if (mi.second.visible) {
-            mis.push_back(mi.second);
+
+        vpP = camera.projP * camera.view;
+        float const lodPixelScale{camera.lodPixelScale};
+        glm::mat4 const viewInverse = glm::inverse(camera.view);
+        glm::vec3 const cameraPosition(viewInverse[3]);
+
+        // A stereo pair is culled from a camera set back behind the middle
+        // of the eyes until its frustum holds both of theirs.
+        glm::mat4 cullVp = vpP;
+        if (rightEye != nullptr) {
+          vpRight = rightEye->projP * rightEye->view;
+          glm::vec3 const rightPosition(glm::inverse(rightEye->view)[3]);
+          glm::vec3 const forward = -glm::vec3(viewInverse[2]);
+          float const aspect = static_cast<float>(camera.width) 
+            / static_cast<float>(camera.height);
+          float const halfFovy = 0.5f * glm::radians(camera.fovy);
+          float const setBack = 0.5f 
+            * glm::distance(cameraPosition, rightPosition) 
+            / (std::tan(halfFovy) * aspect);
+          glm::vec3 const cullPosition = 0.5f 
+            * (cameraPosition + rightPosition) - forward * setBack;
+          cullVp = glm::perspective(2.0f * halfFovy, aspect, 0.1f, 
+              100.0f + setBack) * glm::lookAt(cullPosition, 
+                cullPosition + forward, glm::vec3(viewInverse[1]));
+        }
+        glm::vec4 frustum[6];
+        extractFrustumPlanes(cullVp, frustum);
+
+        for (auto &handle : meshHandles) {
+          handle.instanceCount = 0;
+        }
+
+        // The coarsest level of detail whose clusters cover at most the
+        // allowed error in pixels, given the distance to the instance, is
+        // drawn.
+        uint32_t candidateCount{0};
+        auto addInstance{[&meshHandles, &instanceData, &frustum, 
+          &cameraPosition, &lodPixelScale, &drawStats](uint32_t meshId,
+              glm::vec3 const &position, float rotation, bool testBounds) {
+          MeshHandle const &handle = meshHandles[meshId];
+          glm::vec3 const center = position + handle.boundingCenter;
+          if (testBounds && !handle.isOrthogonal && !isSphereInFrustum(frustum,
+                center, handle.boundingRadius)) {
+            return;
+          }
+          uint32_t drawMeshId = meshId;
+          if (handle.lodCount > 0) {
+            float const distance = std::max(0.1f, 
+                glm::distance(cameraPosition, center) - handle.boundingRadius);
+            float const pixelsPerMeter = lodPixelScale / distance;
+            for (uint32_t level{handle.lodCount}; level > 0; level--) {
+              uint32_t const lodMeshId = handle.firstLodMeshId + level - 1;
+              if (meshHandles[lodMeshId].lodCellSize * pixelsPerMeter <= 1.0f) {
+                drawMeshId = lodMeshId;
+                break;
+              }
+            }
+          }
+          MeshHandle &drawHandle = meshHandles[drawMeshId];
+          instanceData[drawHandle.instanceOffset + drawHandle.instanceCount++] =
+            glm::vec4(position, rotation);
+          drawStats.drawnInstances++;
+        }};
+
+        // Only the grid cells below the frustum, widened by the largest
+        // indexed instance, can hold visible static instances.
+        {
+          glm::mat4 const vpInverse = glm::inverse(cullVp);
+          glm::vec2 regionMin(0.0f, 0.0f);
+          glm::vec2 regionMax(0.0f, 0.0f);
+          for (uint32_t i{0}; i < 8; i++) {
+            glm::vec4 corner = vpInverse * glm::vec4(
+                (i & 1) ? 1.0f : -1.0f, (i & 2) ? 1.0f : -1.0f,
+                (i & 4) ? 1.0f : -1.0f, 1.0f);
+            glm::vec2 const p(corner.x / corner.w, corner.y / corner.w);
+            regionMin = (i == 0) ? p : glm::min(regionMin, p);
+            regionMax = (i == 0) ? p : glm::max(regionMax, p);
+          }
+          glm::vec2 const margin(instanceGrid.maxRadius);
+          glm::vec2 const cellMin = (regionMin - margin - instanceGrid.origin)
+            * (1.0f / instanceGrid.cellSize);
+          glm::vec2 const cellMax = (regionMax + margin - instanceGrid.origin)
+            * (1.0f / instanceGrid.cellSize);
+          int32_t const columnEnd = static_cast<int32_t>(instanceGrid.columns);
+          int32_t const rowEnd = static_cast<int32_t>(instanceGrid.rows);
+          int32_t const column0 = std::max(0, 
+              static_cast<int32_t>(std::floor(cellMin.x)));
+          int32_t const column1 = std::min(columnEnd - 1,
+              static_cast<int32_t>(std::floor(cellMax.x)));
+          int32_t const row0 = std::max(0, 
+              static_cast<int32_t>(std::floor(cellMin.y)));
+          int32_t const row1 = std::min(rowEnd - 1,
+              static_cast<int32_t>(std::floor(cellMax.y)));
+
+          for (int32_t row{row0}; row <= row1; row++) {
+            for (int32_t column{column0}; column <= column1; column++) {
+              uint32_t const cell = row * instanceGrid.columns + column;
+              uint32_t const begin = instanceGrid.cellStart[cell];
+              uint32_t const end = instanceGrid.cellStart[cell + 1];
+              if (begin == end) {
+                continue;
+              }
+              uint32_t const visibility = testBoxInFrustum(frustum,
+                  instanceGrid.cellMin[cell], instanceGrid.cellMax[cell]);
+              if (visibility == 0) {
+                continue;
+              }
+              for (uint32_t j{begin}; j < end; j++) {
+                uint32_t const i = instanceGrid.cellInstances[j];
+                addInstance(meshInstances.meshId[i], meshInstances.position[i],
+                    meshInstances.rotation[i], visibility == 1);
+              }
+            }
+          }
+        }
+        for (uint32_t i : instanceGrid.unindexedInstances) {
+          addInstance(meshInstances.meshId[i], meshInstances.position[i],
+              meshInstances.rotation[i], true);
+        }
+        candidateCount += meshInstances.size();
+
+        for (uint32_t i{0}; i < meshInstancesFrame.size(); i++) {
+          if (meshInstancesFrame.visible[i]) {
+            addInstance(meshInstancesFrame.meshId[i], 
+                meshInstancesFrame.position[i], meshInstancesFrame.rotation[i],
+                true);
+            candidateCount++;
+          }
+        }
+        drawStats.culledInstances = candidateCount - drawStats.drawnInstances;
+
+        // Transparent instances are sorted back to front within their mesh,
+        // and the meshes by their farthest instance.
+        for (uint32_t meshId{0}; meshId < meshHandles.size(); meshId++) {
+          MeshHandle const &mh = meshHandles[meshId];
+          if (mh.instanceCount == 0 || mh.indexCount == 0) {
+            continue;
           }
+          if (mh.isOrthogonal) {
+            drawList.push_back(mh.drawKey);
+            continue;
+          }
+          if (!mh.isTransparent) {
+            // Buckets grow by a quarter octave of the distance to the
+            // nearest instance surface.
+            float nearest{std::numeric_limits<float>::max()};
+            for (uint32_t i{0}; i < mh.instanceCount; i++) {
+              glm::vec3 const position(instanceData[mh.instanceOffset + i]);
+              nearest = std::min(nearest, glm::distance(cameraPosition,
+                    position + mh.boundingCenter) - mh.boundingRadius);
+            }
+            uint64_t const bucket = static_cast<uint64_t>(std::min(63.0f,
+                  4.0f * std::log2(1.0f + std::max(nearest, 0.0f))));
+            drawList.push_back(mh.drawKey 
+                | (bucket << drawKeyDepthBucketShift));
+            continue;
+          }
+          sortedInstances.clear();
+          for (uint32_t i{0}; i < mh.instanceCount; i++) {
+            glm::vec4 const &instance = instanceData[mh.instanceOffset + i];
+            sortedInstances.emplace_back(glm::distance(cameraPosition,
+                  glm::vec3(instance) + mh.boundingCenter), instance);
+          }
+          std::sort(sortedInstances.begin(), sortedInstances.end(),
+              [](std::pair<float, glm::vec4> const &a, 
+                std::pair<float, glm::vec4> const &b) {
+                return a.first > b.first;
+              });
+          for (uint32_t i{0}; i < mh.instanceCount; i++) {
+            instanceData[mh.instanceOffset + i] = sortedInstances[i].second;
+          }
+          uint64_t const depth = std::min(drawKeyDepthMask, 
+              static_cast<uint64_t>(sortedInstances[0].first * 1000.0f));
+          drawList.push_back(
+              (uint64_t{drawPassTransparent} << drawKeyPassShift)
+              | ((drawKeyDepthMask - depth) << drawKeyVaoShift) | meshId);
         }
+        std::sort(drawList.begin(), drawList.end());
+      }
+    }};
 
-        for (auto const &mi : mis) {
-          bool isOverlay = meshHandles[mi.name].isOrthogonal;
+    auto drawScene{[&prepareScene, &meshHandles, &instanceData, &drawList,
+      &glStateCache, &vbo, &programId, &vpId, &vpP, &vpRight, &depthProgramId,
+      &depthVpId, &depthPrepass, &drawStats](RigCamera const &camera,
+        RigCamera const *rightEye) {
+      glStateCache.stateChanges = 0;
+      glStateCache.invalidateBindings();
+
+      prepareScene(camera, rightEye);
+      if (!drawList.empty()) {
+        glBindBuffer(GL_ARRAY_BUFFER, vbo[2]);
+        for (MeshHandle const &mh : meshHandles) {
+          if (mh.instanceCount > 0) {
+            glBufferSubData(GL_ARRAY_BUFFER, 
+                mh.instanceOffset * sizeof(glm::vec4),
+                mh.instanceCount * sizeof(glm::vec4), 
+                &instanceData[mh.instanceOffset]);
+          }
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+      }
 
-          glm::mat4 model = glm::mat4(1.0f);
-          model = glm::translate(model, mi.position);
-          model = glm::rotate(model, glm::pi<float>() - mi.rotation, 
-              glm::vec3(0.0f, 0.0f, 1.0f));
+      // The eyes of a stereo pair are drawn one after the other from the
+      // same draw list and instances.
+      for (RigCamera const *eye : {&camera, rightEye}) {
+        if (eye == nullptr) {
+          continue;
+        }
+        glm::mat4 const &vp = (eye == &camera) ? vpP : vpRight;
+        glBindFramebuffer(GL_FRAMEBUFFER, eye->fbo[0]);
+        glViewport(0, 0, eye->width, eye->height);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        glStateCache.useProgram(programId);
+        if (drawList.empty()) {
+          continue;
+        }
 
-          glm::mat4 mvp;
-          if (!isOverlay) {
-            mvp = projP * view * model;
-          } else {
-            mvp = projO * model;
-            glDepthMask(false);
+        // The pre-pass lays down the depth of all opaque geometry without
+        // shading it, so that the colour pass only shades visible fragments.
+        if (depthPrepass) {
+          glStateCache.useProgram(depthProgramId);
+          glUniformMatrix4fv(depthVpId, 1, GL_FALSE, &vp[0][0]);
+          glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+          for (uint64_t const drawKey : drawList) {
+            if ((drawKey >> drawKeyPassShift) != drawPassOpaque) {
+              break;
+            }
+            MeshHandle const &mh = meshHandles[drawKey & drawKeyMeshIdMask];
+            glStateCache.bindVertexArray(mh.vao);
+            glDrawElementsInstanced(GL_TRIANGLES, mh.indexCount,
+                GL_UNSIGNED_INT, reinterpret_cast<void *>(mh.indexOffset),
+                mh.instanceCount);
+            drawStats.drawCalls++;
+          }
+          glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+          glDepthFunc(GL_LEQUAL);
+          glStateCache.useProgram(programId);
+        }
+
+        uint64_t pass{std::numeric_limits<uint64_t>::max()};
+        for (uint64_t const drawKey : drawList) {
+          MeshHandle const &mh = meshHandles[drawKey & drawKeyMeshIdMask];
+          if ((drawKey >> drawKeyPassShift) != pass) {
+            pass = drawKey >> drawKeyPassShift;
+            if (pass == drawPassOverlay) {
+              glUniformMatrix4fv(vpId, 1, GL_FALSE, &eye->projO[0][0]);
+            } else {
+              glUniformMatrix4fv(vpId, 1, GL_FALSE, &vp[0][0]);
+            }
+            glStateCache.setDepthMask(pass == drawPassOpaque && !depthPrepass);
+            glStateCache.setBlend(pass != drawPassOpaque);
+            glStateCache.stateChanges++;
           }
-          glUniformMatrix4fv(mvpId, 1, GL_FALSE, &mvp[0][0]);
-          
-          if (meshHandles[mi.name].textureId != 0) {
-            glBindTexture(GL_TEXTURE_2D, meshHandles[mi.name].textureId);
+
+          if (mh.textureId != 0) {
+            glStateCache.bindTexture(mh.textureId);
           }
-          glBindVertexArray(meshHandles[mi.name].vao);
-          glDrawElements(GL_TRIANGLES, meshHandles[mi.name].indexCount,
-              GL_UNSIGNED_INT, 
-              reinterpret_cast<void *>(meshHandles[mi.name].indexOffset));
-          
-          glBindVertexArray(0);
+          glStateCache.bindVertexArray(mh.vao);
+          glDrawElementsInstanced(GL_TRIANGLES, mh.indexCount,
+              GL_UNSIGNED_INT, reinterpret_cast<void *>(mh.indexOffset),
+              mh.instanceCount);
+          drawStats.drawCalls++;
+          drawStats.drawnTriangles += mh.indexCount / 3 * mh.instanceCount;
+        }
+        glStateCache.setDepthMask(true);
+        glStateCache.setBlend(false);
+        glStateCache.bindVertexArray(0);
+        if (depthPrepass) {
+          glDepthFunc(GL_LESS);
+        }
+      }
+      drawStats.stateChanges = glStateCache.stateChanges;
+    }};
+
+    // Images are read back into a ring of pixel buffer objects per camera.
+    // The readback issued readbackDepth - 1 ticks ago is published after the
+    // current one has been queued, so that the GPU can work on this frame in
+    // the meantime.
+    //
+    // Where ARB_buffer_storage is supported, the buffers are given immutable
+    // storage that stays mapped and coherent, so that publishing a readback
+    // is a copy out of client memory once its fence has signaled, with no map
+    // or unmap calls into the driver.
+    bool const isPersistentlyMapped{GLEW_ARB_buffer_storage == GL_TRUE};
+    auto createReadbackBuffer{[&isPersistentlyMapped](GLuint &pbo,
+        void const *&data, uint32_t size) {
+      glGenBuffers(1, &pbo);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo);
+      if (isPersistentlyMapped) {
+        GLbitfield const flags{GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT
+          | GL_MAP_COHERENT_BIT};
+        glBufferStorage(GL_PIXEL_PACK_BUFFER, size, nullptr, flags);
+        data = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+      } else {
+        glBufferData(GL_PIXEL_PACK_BUFFER, size, nullptr, GL_STREAM_READ);
+      }
+    }};
+    for (auto &camera : cameras) {
+      camera.readbackSlots.resize(readbackDepth);
+      for (auto &slot : camera.readbackSlots) {
+        createReadbackBuffer(slot.pboArgb, slot.dataArgb, camera.memSizeArgb);
+        createReadbackBuffer(slot.pboI420, slot.dataI420,
+            camera.width * camera.i420Rows);
+      }
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (verbose) {
+      std::clog << "Reading back images through " << readbackDepth
+        << (isPersistentlyMapped ? " persistently mapped" : "")
+        << " pixel buffer object(s) per output" << std::endl;
+    }
+
+    StreamCopier streamCopier(copyThreads);
+
+    // The CPU renderers draw into their own buffers, from which the images
+    // are published directly. The GL pipeline is then only used to show the
+    // preview.
+    WorkerPool workerPool(cpuRendering ? renderThreads : 1);
+    glm::vec2 const overlaySize(overlayWidth, overlayHeight);
+    for (auto &camera : cameras) {
+      if (softwareRendering) {
+        camera.softwareRenderer.reset(new SoftwareRenderer(camera.width,
+              camera.height, workerPool));
+      }
+      if (rayCasting) {
+        camera.rayCaster.reset(new RayCaster(camera.width, camera.height,
+              workerPool, rayScene, meshGeometry, overlaySize));
+      }
+      if (cpuRendering) {
+        camera.i420Image.resize(camera.memSizeI420);
+      }
+    }
+    if (cpuRendering && verbose) {
+      std::clog << "Rendering by " << renderer << " with "
+        << workerPool.size() << " thread(s)" << std::endl;
+    }
 
-          if (isOverlay) {
-            glDepthMask(true);
+    // Renders the scene of a camera, and of its right eye if any, on the CPU
+    // into their renderers. Frame instances are ray cast from a copy taken
+    // together with the views.
+    std::vector<RayInstance> frameRayInstances;
+    auto drawSceneCpu{[&prepareScene, &rayScene, &frameRayInstances,
+      &hasFrame, &vpP, &vpRight, &drawList, &meshHandles, &meshGeometry,
+      &softwareTextures, &instanceData, &meshInstancesFrame,
+      &meshInstancesFrameRow, &meshInstancesFrameMutex,
+      &drawStats](RigCamera &camera, RigCamera *rightEye) {
+      if (camera.softwareRenderer) {
+        prepareScene(camera, rightEye);
+        camera.softwareRenderer->render(drawList, meshHandles, meshGeometry,
+            softwareTextures, instanceData, vpP, camera.projO, drawStats);
+        if (rightEye != nullptr) {
+          rightEye->softwareRenderer->render(drawList, meshHandles,
+              meshGeometry, softwareTextures, instanceData, vpRight,
+              rightEye->projO, drawStats);
+        }
+        return;
+      }
 
+      drawStats = DrawStats();
+      frameRayInstances.clear();
+      glm::mat4 castView(1.0f);
+      glm::mat4 rightView(1.0f);
+      bool hasView{false};
+      {
+        std::lock_guard<std::mutex> lock(meshInstancesFrameMutex);
+        hasView = hasFrame;
+        vpP = camera.projP * camera.view;
+        castView = camera.view;
+        if (rightEye != nullptr) {
+          vpRight = rightEye->projP * rightEye->view;
+          rightView = rightEye->view;
+        }
+        for (auto const &row : meshInstancesFrameRow) {
+          if (meshInstancesFrame.visible[row.second]) {
+            frameRayInstances.emplace_back(
+                meshInstancesFrame.position[row.second],
+                meshInstancesFrame.rotation[row.second],
+                meshInstancesFrame.meshId[row.second], 0x80000000u | row.first);
           }
         }
       }
+      if (hasView) {
+        camera.rayCaster->render(vpP, castView, frameRayInstances);
+        if (rightEye != nullptr) {
+          rightEye->rayCaster->render(vpRight, rightView, frameRayInstances);
+        }
+        drawStats.drawnInstances = static_cast<uint32_t>(
+            rayScene.instances.size() + frameRayInstances.size());
+      } else {
+        camera.rayCaster->clear();
+        if (rightEye != nullptr) {
+          rightEye->rayCaster->clear();
+        }
+      }
     }};
 
-    std::vector<uint8_t> buf(memSize);
-    bool flippedY{false};
-    auto atFrequency{[&doI420Id, &fbo, &projP, &width, &height, &memSize, &buf,
-      &flippedY, &sharedMemoryArgb, &sharedMemoryI420, &drawScene, &display,
-      &win, &verbose]() -> bool
+    // In verbose mode, the GPU time of the scene pass is measured with timer
+    // queries, read one tick later so that they never stall rendering. A GL
+    // 3.0 context may lack them, in which case the pass is timed on the CPU
+    // up to its completion.
+    bool const hasTimerQueries{GLEW_ARB_timer_query == GL_TRUE
+      || GLEW_EXT_timer_query == GL_TRUE};
+    for (auto &camera : cameras) {
+      glGenQueries(2, camera.timerQueries);
+    }
+
+    // Renders one tick of a camera, and publishes its oldest readback. The
+    // right eye of a stereo pair is rendered in the same tick, from the same
+    // frame, and its images carry the same sample time stamps as the left.
+    auto renderCamera{[&yuvProgramId, &yuvSizeId, &emptyVao, &cameras,
+      &streamCopier, &drawScene, &drawStats, &glContext, &showPreview,
+      &meshInstancesFrameMutex, &alwaysRender, &cpuRendering, &drawSceneCpu,
+      &workerPool, &verbose, &hasTimerQueries](RigCamera &camera)
       {
-        cluon::data::TimeStamp sampleTimeStamp = cluon::time::now();
-
-        if (!flippedY) {
-          projP *= glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, 1.0f));
-          flippedY = true;
-        }
-        glBindFramebuffer(GL_FRAMEBUFFER, fbo[0]);
-        glReadBuffer(GL_COLOR_ATTACHMENT0);
-        glUniform1i(doI420Id, 0);
-        drawScene();
-        glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, &buf[0]);
-        sharedMemoryArgb.lock();
-        sharedMemoryArgb.setTimeStamp(sampleTimeStamp);
-        {
-          memcpy(sharedMemoryArgb.data(), buf.data(), memSize);
-        }
-        sharedMemoryArgb.unlock();
-        sharedMemoryArgb.notifyAll();
-
-        glBindFramebuffer(GL_FRAMEBUFFER, fbo[1]);
-        glReadBuffer(GL_COLOR_ATTACHMENT0);
-        glUniform1i(doI420Id, 1);
-        drawScene();
-        glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE, &buf[0]);
-        sharedMemoryI420.lock();
-        sharedMemoryI420.setTimeStamp(sampleTimeStamp);
+        RigCamera *rightEye = (camera.rightEye != 0)
+          ? &cameras[camera.rightEye] : nullptr;
+        std::vector<RigCamera *> eyes{&camera};
+        if (rightEye != nullptr) {
+          eyes.push_back(rightEye);
+        }
+        bool const isPreviewed{showPreview && &camera == &cameras[0]};
+
+        // An unchanged scene is not rendered again. Readbacks still in
+        // flight are published one per tick, after which the image in shared
+        // memory is republished under the new time stamp.
+        bool isSceneChanged{alwaysRender};
         {
-          memcpy(sharedMemoryI420.data(), buf.data(), memSize);
+          std::lock_guard<std::mutex> lock(meshInstancesFrameMutex);
+          for (RigCamera *eye : eyes) {
+            isSceneChanged = isSceneChanged || eye->isSceneDirty;
+            eye->isSceneDirty = false;
+          }
         }
-        sharedMemoryI420.unlock();
-        sharedMemoryI420.notifyAll();
 
-        if (verbose) {
-          if (flippedY) {
-            projP *= glm::scale(glm::mat4(1.0f), glm::vec3(1.0f, -1.0f, 1.0f));
-            flippedY = false;
+        if (isSceneChanged && cpuRendering) {
+          cluon::data::TimeStamp const sampleTimeStamp{cluon::time::now()};
+          auto const start = std::chrono::steady_clock::now();
+          drawSceneCpu(camera, rightEye);
+          camera.sceneMilliseconds = std::chrono::duration<double, std::milli>(
+              std::chrono::steady_clock::now() - start).count();
+
+          for (RigCamera *eye : eyes) {
+            uint32_t const width{eye->width};
+            uint32_t const height{eye->height};
+            uint8_t const *image = eye->softwareRenderer
+              ? eye->softwareRenderer->colorData()
+              : eye->rayCaster->colorData();
+            publishImage(*eye->sharedMemoryArgb, image, eye->memSizeArgb,
+                sampleTimeStamp, streamCopier);
+            convertBgraToI420(image, width, height, eye->i420Image.data(),
+                workerPool);
+            publishImage(*eye->sharedMemoryI420, eye->i420Image.data(),
+                eye->memSizeI420, sampleTimeStamp, streamCopier);
+            if (eye->sharedMemoryDepth) {
+              publishImage(*eye->sharedMemoryDepth,
+                  eye->rayCaster->depthData(), width * height * 4,
+                  sampleTimeStamp, streamCopier);
+            }
+            if (eye->sharedMemoryObjectId) {
+              publishImage(*eye->sharedMemoryObjectId,
+                  eye->rayCaster->objectIdData(), width * height * 4,
+                  sampleTimeStamp, streamCopier);
+            }
+
+            if (isPreviewed && eye == &camera) {
+              glBindTexture(GL_TEXTURE_2D, camera.tex[0]);
+              glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_BGRA,
+                  GL_UNSIGNED_BYTE, image);
+              glBindTexture(GL_TEXTURE_2D, 0);
+              glBindFramebuffer(GL_READ_FRAMEBUFFER, camera.fbo[0]);
+              glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+              glBlitFramebuffer(0, 0, width, height, 0, height, width, 0,
+                  GL_COLOR_BUFFER_BIT, GL_NEAREST);
+              glXSwapBuffers(glContext.display, glContext.win);
+            }
+          }
+        } else if (isSceneChanged) {
+          cluon::data::TimeStamp const sampleTimeStamp{cluon::time::now()};
+
+          glEnable(GL_DEPTH_TEST);
+          if (verbose && hasTimerQueries) {
+            uint32_t const query = camera.tickCount % 2;
+            glBeginQuery(GL_TIME_ELAPSED, camera.timerQueries[query]);
+            drawScene(camera, rightEye);
+            glEndQuery(GL_TIME_ELAPSED);
+            camera.timerQueryIssued[query] = true;
+
+            uint32_t const previousQuery = (camera.tickCount + 1) % 2;
+            GLuint available{GL_FALSE};
+            if (camera.timerQueryIssued[previousQuery]) {
+              glGetQueryObjectuiv(camera.timerQueries[previousQuery],
+                  GL_QUERY_RESULT_AVAILABLE, &available);
+            }
+            if (available == GL_TRUE) {
+              GLuint64 elapsed;
+              if (GLEW_ARB_timer_query == GL_TRUE) {
+                glGetQueryObjectui64v(camera.timerQueries[previousQuery],
+                    GL_QUERY_RESULT, &elapsed);
+              } else {
+                glGetQueryObjectui64vEXT(camera.timerQueries[previousQuery],
+                    GL_QUERY_RESULT, &elapsed);
+              }
+              camera.sceneMilliseconds = static_cast<double>(elapsed) / 1.0e6;
+            }
+          } else if (verbose) {
+            auto const start = std::chrono::steady_clock::now();
+            drawScene(camera, rightEye);
+            glFinish();
+            camera.sceneMilliseconds = std::chrono::duration<double, 
+              std::milli>(std::chrono::steady_clock::now() - start).count();
+          } else {
+            drawScene(camera, rightEye);
+          }
+
+          for (RigCamera *eye : eyes) {
+            uint32_t const width{eye->width};
+            uint32_t const height{eye->height};
+            ReadbackSlot &slot = eye->readbackSlots[eye->readbackIndex];
+            slot.sampleTimeStamp = sampleTimeStamp;
+
+            glBindFramebuffer(GL_FRAMEBUFFER, eye->fbo[0]);
+            glReadBuffer(GL_COLOR_ATTACHMENT0);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pboArgb);
+            glReadPixels(0, 0, width, height, GL_BGRA, GL_UNSIGNED_BYTE,
+                nullptr);
+
+            glBindFramebuffer(GL_FRAMEBUFFER, eye->fbo[1]);
+            glViewport(0, 0, width, eye->i420Rows);
+            glDisable(GL_DEPTH_TEST);
+            glUseProgram(yuvProgramId);
+            glUniform2i(yuvSizeId, width, height);
+            glBindTexture(GL_TEXTURE_2D, eye->tex[0]);
+            glBindVertexArray(emptyVao);
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            glBindVertexArray(0);
+            glReadBuffer(GL_COLOR_ATTACHMENT0);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pboI420);
+            glReadPixels(0, 0, width, eye->i420Rows, GL_RED, GL_UNSIGNED_BYTE,
+                nullptr);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+            slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+          }
+
+          if (isPreviewed) {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, camera.fbo[0]);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+            glBlitFramebuffer(0, 0, camera.width, camera.height, 0,
+                camera.height, camera.width, 0, GL_COLOR_BUFFER_BIT,
+                GL_NEAREST);
+
+            glXSwapBuffers(glContext.display, glContext.win);
+          }
+        }
+        if (isSceneChanged && verbose
+            && camera.tickCount++ % std::max(camera.freq, 1u) == 0) {
+          if (cameras.size() > 1) {
+            std::clog << "Camera " << (&camera - &cameras[0]) << ": ";
+          }
+          std::clog << "Drew " << drawStats.drawnInstances << " instances ("
+            << drawStats.culledInstances << " culled) in "
+            << drawStats.drawCalls << " draw calls with "
+            << drawStats.stateChanges << " state changes, "
+            << drawStats.drawnTriangles << " triangles, scene pass "
+            << camera.sceneMilliseconds << " ms" << std::endl;
+        }
+
+        // The readbacks in flight are in order of age from the slot after
+        // readbackIndex, which is filled next. A rendered tick publishes
+        // the oldest slot once the ring has wrapped around, and a tick that
+        // rendered nothing publishes the oldest readback still in flight.
+        // Only once none is left is the image in shared memory republished,
+        // so that time stamps never go backwards. The depth and object id
+        // images are republished along with it, and republished images of
+        // both eyes share one time stamp as well.
+        cluon::data::TimeStamp const unchangedTimeStamp{cluon::time::now()};
+        for (RigCamera *eye : eyes) {
+          uint32_t const slotCount{
+            static_cast<uint32_t>(eye->readbackSlots.size())};
+          ReadbackSlot *oldestSlot{nullptr};
+          if (isSceneChanged) {
+            eye->readbackIndex = (eye->readbackIndex + 1) % slotCount;
+            oldestSlot = &eye->readbackSlots[eye->readbackIndex];
+          } else {
+            for (uint32_t i{1}; i < slotCount && oldestSlot == nullptr; i++) {
+              ReadbackSlot &slot = 
+                eye->readbackSlots[(eye->readbackIndex + i) % slotCount];
+              if (slot.fence != 0) {
+                oldestSlot = &slot;
+              }
+            }
+          }
+          if (oldestSlot != nullptr && oldestSlot->fence != 0) {
+            while (glClientWaitSync(oldestSlot->fence,
+                  GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000)
+                == GL_TIMEOUT_EXPIRED) {
+            }
+            glDeleteSync(oldestSlot->fence);
+            oldestSlot->fence = 0;
+
+            publishReadback(*eye->sharedMemoryArgb, oldestSlot->pboArgb,
+                oldestSlot->dataArgb, eye->memSizeArgb,
+                oldestSlot->sampleTimeStamp, streamCopier);
+            publishReadback(*eye->sharedMemoryI420, oldestSlot->pboI420,
+                oldestSlot->dataI420, eye->memSizeI420,
+                oldestSlot->sampleTimeStamp, streamCopier);
+          } else if (!isSceneChanged) {
+            republishTimeStamp(*eye->sharedMemoryArgb, unchangedTimeStamp);
+            republishTimeStamp(*eye->sharedMemoryI420, unchangedTimeStamp);
+            if (eye->sharedMemoryDepth) {
+              republishTimeStamp(*eye->sharedMemoryDepth, unchangedTimeStamp);
+            }
+            if (eye->sharedMemoryObjectId) {
+              republishTimeStamp(*eye->sharedMemoryObjectId, 
+                  unchangedTimeStamp);
+            }
           }
-          glBindFramebuffer(GL_FRAMEBUFFER, 0);
-          glUniform1i(doI420Id, 0);
-          drawScene();
-  
-          glXSwapBuffers(display, win);
         }
-        return true;
       }};
 
     glClearDepth(1.0f);
@@ -1134,30 +5404,82 @@ void main()
     glEnable(GL_DEPTH_TEST);
     glDepthFunc(GL_LESS);
 
-    glEnable(GL_BLEND);
     glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-
-    glUseProgram(programId);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+    // Every camera renders at its own frequency, on the main thread that
+    // owns the GL context, which sleeps until the next camera is due. A
+    // camera that falls behind renders on the next pass instead of trying to
+    // catch up. Right eyes are rendered along with their left eyes.
+    auto periodOf{[&timemod](RigCamera const &camera) {
+      return std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(1.0 / (timemod * camera.freq)));
+    }};
+    auto const start = std::chrono::steady_clock::now();
+    for (auto &camera : cameras) {
+      camera.nextTick = start;
+    }
 
     cluon::OD4Session od4{cid};
     od4.dataTrigger(opendlv::sim::Frame::ID(), onFrame);
-    od4.timeTrigger(timemod * freq, atFrequency);
-        
-    glDeleteFramebuffers(2, fbo);
-    glDeleteTextures(2, tex);
-    glDeleteRenderbuffers(2, rbo);
-    glDeleteBuffers(2, vbo);
+    while (od4.isRunning()) {
+      if (poseTrigger) {
+        // Renders as soon as a pose is ready, but no camera more often than
+        // its frequency. The scene is drawn from the latest pose once the
+        // wait is over, by every camera that is due by then.
+        std::unique_lock<std::mutex> lock(meshInstancesFrameMutex);
+        poseCondition.wait_for(lock, std::chrono::milliseconds(100),
+            [&isPoseReady]() { return isPoseReady; });
+        if (!isPoseReady) {
+          continue;
+        }
+        isPoseReady = false;
+      }
+      auto nextTick = cameras[0].nextTick;
+      for (auto const &camera : cameras) {
+        if (!camera.isRightEye) {
+          nextTick = std::min(nextTick, camera.nextTick);
+        }
+      }
+      std::this_thread::sleep_until(nextTick);
+      auto const now = std::chrono::steady_clock::now();
+      for (auto &camera : cameras) {
+        if (!camera.isRightEye && camera.nextTick <= now) {
+          renderCamera(camera);
+          camera.nextTick = std::max(camera.nextTick + periodOf(camera),
+              poseTrigger ? now + periodOf(camera) : now);
+        }
+      }
+    }
+
+    glDeleteBuffers(5, vbo);
+    glDeleteVertexArrays(1, &emptyVao);
+    for (auto &camera : cameras) {
+      glDeleteFramebuffers(2, camera.fbo);
+      glDeleteTextures(2, camera.tex);
+      glDeleteRenderbuffers(1, &camera.rbo);
+      glDeleteQueries(2, camera.timerQueries);
+      for (auto &slot : camera.readbackSlots) {
+        if (slot.fence != 0) {
+          glDeleteSync(slot.fence);
+        }
+        if (slot.dataArgb != nullptr) {
+          glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pboArgb);
+          glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+          glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pboI420);
+          glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+          glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        glDeleteBuffers(1, &slot.pboArgb);
+        glDeleteBuffers(1, &slot.pboI420);
+      }
+    }
 
-    for (auto mi : meshHandles) {
-      glDeleteVertexArrays(1, &mi.second.vao);
+    for (auto const &mh : meshHandles) {
+      glDeleteVertexArrays(1, &mh.vao);
     }
-  
-    glXMakeCurrent(display, 0, 0);
-    glXDestroyContext(display, ctx);
 
-    XDestroyWindow(display, win);
-    XFreeColormap(display, cmap);
-    XCloseDisplay(display);
+    destroyGlContext(glContext);
   }
 
   return retCode;